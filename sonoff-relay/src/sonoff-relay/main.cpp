@@ -18,140 +18,285 @@
 #define SONOFF_LED      13
 #define SONOFF_INPUT    14
 
+// Settings used to be kept in EEPROM, validated with this salt. They're
+// migrated to the settings store on the first boot.
 #define EEPROM_SALT 1263
 
+// How long the MQTT client, local control and the button can go unpolled
+// before it counts against their deadline in the task stats.
+#define URGENT_DEADLINE_MS 50
+
+// The relay state is written to flash at most this often. Changes in between
+// are kept in RTC memory and written once the interval is up, so a flapping
+// automation costs one flash write per interval rather than one per toggle.
+#define STATE_SAVE_MIN_MS 10000
+#define STATE_RTC_MAGIC   0x524c5932 // "RLY2"
+
+// Timed relay commands run off timer1 at 312.5kHz (80MHz / 256). Its counter
+// is 23 bits, about 26s, so longer delays are chained in chunks of 20s.
+#define RELAY_TIMER_TICKS(ms)     ((ms) * 625 / 2)
+#define RELAY_TIMER_CHUNK_TICKS   6250000
+// Longest delay a timed command accepts, an hour. Any longer and the tick
+// count overflows.
+#define RELAY_TIMER_MAX_MS        (1000UL * 60 * 60)
+
+// Optional control over UDP on the local network, skipping the broker. Only
+// listened on once a key is set, see localControlTick().
+#define LOCAL_CONTROL_PORT        4210
+#define LOCAL_CONTROL_MAGIC       0x4b48 // "HK"
+#define LOCAL_CONTROL_VERSION     1
+// Longest command text a request can carry.
+#define LOCAL_CONTROL_MAX_COMMAND 24
+
+// Group topics are "device/group/<name>/<suffix>", and take the same
+// relay/set, republish and power-on/set as a device's own topics.
+#define GROUP_TOPIC_PREFIX "device/group/"
+
+// How long after connecting to wait for the broker's retained copy of our
+// reported shadow before publishing it regardless.
+#define SHADOW_RECONCILE_MS 2000
+
 #include <ESP8266WiFi.h>
 #include <ESP8266mDNS.h>
 #include <WiFiManager.h>
 #include <PubSubClient.h>
 #include <Ticker.h>
-#include <EEPROM.h>
-#include <Button.h>
+#include <HomekitFlash.h>
+#include <HomekitRtc.h>
+#include <HomekitSettings.h>
+#include <HomekitButton.h>
+#include <HomekitAuth.h>
+#include <HomekitBindings.h>
+#include <HomekitGroups.h>
+#include <HomekitScheduler.h>
+#include <HomekitWifi.h>
+#include <HomekitConnection.h>
+#include <HomekitMetrics.h>
+#include <WiFiUdp.h>
 
 enum relayState {
   RELAY_STATE_ON = HIGH,
   RELAY_STATE_OFF = LOW,
 };
 
+// What to do with the relay at boot.
+enum powerOnPolicy {
+  POWER_ON_LAST,
+  POWER_ON_ON,
+  POWER_ON_OFF,
+};
+
+enum localControlStatus {
+  LOCAL_CONTROL_OK,
+  LOCAL_CONTROL_INVALID,
+  // The boot or sequence number was wrong. The reply carries the right boot
+  // number and the last sequence number accepted.
+  LOCAL_CONTROL_STALE,
+};
+
 
 typedef struct {
-  int   salt = EEPROM_SALT;
-  char  mqttAddress[30] = "";
-  char  mqttUser[17] = "";
-  char  mqttPassword[17] = "";
-  int   mqttPort = 8883;
-} WMSettings;
-
-static WMSettings settings;
+  uint8_t   state;
+  uint8_t   policy;
+  uint16_t  reserved;
+  // The last shadow/desired version applied. Missing from records written by
+  // older firmware.
+  uint32_t  version;
+} SavedState;
+
+// Starts every local control datagram, both ways. Requests follow it with a
+// command as accepted on relay/set, or "get"; replies with the relay state,
+// '0' or '1'. Then comes a tag over everything before it. Each boot picks a
+// new boot number and only takes sequence numbers higher than the last, so a
+// captured request can't be replayed.
+typedef struct __attribute__((packed)) {
+  uint16_t  magic;
+  uint8_t   version;
+  uint8_t   status;
+  uint32_t  boot;
+  uint32_t  sequence;
+} LocalControlHeader;
+
+static HomekitSettingsStore settingsStore;
+static HomekitSettings settings;
+// The portal asks for the local key too.
+static HomekitWifi wifi(true);
 static enum relayState currentState;
+static enum powerOnPolicy powerOnPolicy = POWER_ON_LAST;
+static HomekitFlashRing stateStore(HOMEKIT_FLASH_STATE, HOMEKIT_FLASH_STATE_SECTORS);
+static SavedState flashState;
+static bool stateSavePending = false;
+
+// Shared with the timer1 interrupt handler.
+static volatile uint32_t relayTimerRemaining = 0;
+static volatile uint8_t relayTimerTarget;
+static volatile bool relayTimerPending = false;
+static volatile bool relayTimerFired = false;
+// When set, every switch on is followed by a switch off this many ms later.
+static uint32_t inchingMs = 0;
+static unsigned long lastStateSaveAt = 0;
 static Ticker ticker;
-static Button button(SONOFF_BUTTON, false, true, 20);
-static bool shouldSaveConfig = false;
+static HomekitButton button(SONOFF_BUTTON);
+
 
 static WiFiClientSecure espClient;
 static PubSubClient client(espClient);
 
+static HomekitConnection connection(client);
+
+static WiFiUDP localControl;
+static bool localControlActive = false;
+static uint32_t localControlBoot;
+static uint32_t localControlSequence = 0;
+// Set when the state changed without being published, to catch MQTT up
+// after the local reply has gone or, for a group command, at notifyAt.
+static bool notifyPending = false;
+static bool policyNotifyPending = false;
+static unsigned long notifyAt = 0;
+// Set while a command sent to a group is being handled.
+static bool groupRequest = false;
+
+// The device shadow, see applyDesired().
+static uint32_t desiredVersion = 0;
+static bool shadowReconciled = false;
+static unsigned long shadowReconcileAt = 0;
+static HomekitBindings bindings;
+static HomekitScheduler scheduler;
+
 static String topicRelayState;
 static String topicRelaySet;
 static String topicReboot;
 static String topicRepublish;
 static String topicReset;
+static String topicMetrics;
+static String topicPowerOn;
+static String topicPowerOnSet;
+static String topicLocalKeySet;
+static String topicBindings;
+static String topicBindingsSet;
+static String topicPrefix;
+static String topicGroups;
+static String topicGroupsSet;
+static String topicShadowDesired;
+static String topicShadowReported;
+static String topicTasks;
+
+static bool bootReported = false;
 
 
 void ledTick();
 void setState(enum relayState s);
 void setState(enum relayState s, bool notify);
-void onEnterConfigMode (WiFiManager *wifi);
-void onSaveConfig();
 void toggle();
 void reboot();
 void reset();
 String getPlainMac(void);
 void makeTopicStrings();
 void notifyState();
-
-void mqttReconnect();
+void publishBootMetrics();
+void restoreState();
+void saveState();
+void stateTick();
+void setPowerOnPolicy(byte* payload, unsigned int length);
+void notifyPowerOnPolicy();
+void scheduleRelay(enum relayState s, uint32_t ms);
+void cancelRelayTimer();
+enum relayState oppositeState();
+void relayTimerTick();
+bool runCommand(byte* payload, unsigned int length, bool notify);
+bool runRelayCommand(byte* payload, unsigned int length, bool notify);
+void armRelayTimer();
+void onRelayTimer();
+void onWifiConnected();
+void startLocalControl();
+void localControlTick();
+void replyLocalControl(enum localControlStatus status, uint32_t sequence);
+void setLocalKey(byte* payload, unsigned int length);
+void setBindings(byte* payload, unsigned int length);
+void bindingsTick();
+void updateDoublePressWindow();
+void setGroups(byte* payload, unsigned int length);
+void subscribeGroups(bool subscribe);
+void groupCallback(const char* topic, byte* payload, unsigned int length);
+void deferNotify();
+void applyDesired(byte* payload, unsigned int length);
+void checkReported(byte* payload, unsigned int length);
+size_t formatReported(char* buff, size_t size);
+void publishReported();
+void shadowTick();
+void buttonTick();
+void publishTasks();
+void publishMetric(const char *name, const char *value);
+
+void mqttTick();
+bool mqttConnect();
+void onMqttConnected();
 void mqttCallback(char* topic, byte* payload, unsigned int length);
 
 void setup() {
   Serial.begin(115200);
 
 
-  makeTopicStrings();
-
   //set led pin as output
   pinMode(SONOFF_LED, OUTPUT);
   pinMode(SONOFF_RELAY, OUTPUT);
+  button.begin();
+  timer1_attachInterrupt(onRelayTimer);
+
+  // Put the relay back the way it was before anything else, Wi-Fi included.
+  restoreState();
 
-  // Set the relay state so it's immediately on, but don't notify.
-  setState(RELAY_STATE_ON, false);
+  makeTopicStrings();
 
   // Start a ticker to show that we're in config mode on the LED.
   ticker.attach(0.2, ledTick);
 
-  WiFiManager wifiManager;
-  wifiManager.setAPCallback(onEnterConfigMode);
-  wifiManager.setConfigPortalTimeout(180); //Reboot if it's not configured.
-
   // Handle Config Params
-  EEPROM.begin(512);
-  EEPROM.get(0, settings);
-  EEPROM.end();
-
-  if (settings.salt != EEPROM_SALT) {
-    Serial.println("Invalid settings in EEPROM, trying with defaults");
-    WMSettings defaults;
+  bool configured = settingsStore.begin() &&
+      (settingsStore.load(settings) || settingsStore.migrateEeprom(HOMEKIT_LEGACY_RELAY, EEPROM_SALT, settings));
+  if (!configured) {
+    Serial.println("No saved settings, trying with defaults");
+    HomekitSettings defaults;
     settings = defaults;
   }
 
-  WiFiManagerParameter mqttServerAddress("mqtt-server-address", "MQTT Server Address", settings.mqttAddress, 30);
-  WiFiManagerParameter mqttServerPort("mqtt-server-port", "MQTT Server Port", String(settings.mqttPort).c_str(), 6);
-  WiFiManagerParameter mqttUsername("mqtt-username", "MQTT User", settings.mqttUser, 16);
-  WiFiManagerParameter mqttPassword("mqtt-password", "MQTT Password", settings.mqttPassword, 16);
-  wifiManager.addParameter(&mqttServerAddress);
-  wifiManager.addParameter(&mqttServerPort);
-  wifiManager.addParameter(&mqttUsername);
-  wifiManager.addParameter(&mqttPassword);
-
-  //set config save notify callback
-  wifiManager.setSaveConfigCallback(onSaveConfig);
-
   String hostname = "Sonoff-" + getPlainMac();
 
-  if (!wifiManager.autoConnect(hostname.c_str())) {
-    Serial.println("failed to connect and hit timeout");
-    reboot();
-  }
-
-  if (shouldSaveConfig) {
-    Serial.println("Saving config");
-
-    strcpy(settings.mqttAddress, mqttServerAddress.getValue());
-    strcpy(settings.mqttUser, mqttUsername.getValue());
-    strcpy(settings.mqttPassword, mqttPassword.getValue());
-    settings.mqttPort = atoi(mqttServerPort.getValue());
-
-    EEPROM.begin(512);
-    EEPROM.put(0, settings);
-    EEPROM.end();
-  }
+  // Entering config mode makes the LED blink faster.
+  wifi.begin(settings, []() {
+    ticker.attach(0.2, ledTick);
+  });
+  bindings.begin();
+  updateDoublePressWindow();
+  bool online = wifi.connect(hostname.c_str(), configured);
 
-  ticker.detach(); // Stop Blinking LED
   Serial.println("Device is started...");
-  Serial.printf("settings.mqttAddress: '%s'\n", settings.mqttAddress);
-  Serial.printf("settings.mqttPort: '%d'\n", settings.mqttPort);
-  Serial.printf("settings.mqttUser: '%s'\n", settings.mqttUser);
-  Serial.printf("settings.mqttPassword: '%s'\n", settings.mqttPassword);
   Serial.printf("topicRelaySet: '%s'\n", topicRelaySet.c_str());
   Serial.printf("topicRelayState: '%s'\n", topicRelayState.c_str());
   Serial.printf("topicReboot: '%s'\n", topicReboot.c_str());
-
-  setState(RELAY_STATE_ON);
+  if (online) {
+    onWifiConnected();
+  }
 
   // Connect to MQTT
+  espClient.setTimeout(HOMEKIT_CONNECT_TIMEOUT_MS);
   client.setServer(settings.mqttAddress, settings.mqttPort);
   client.setCallback(mqttCallback);
-
+  connection.begin(mqttConnect, onMqttConnected);
+
+  // Anything that can switch the relay is urgent, and runs again between
+  // every other task. Saving state to flash can wait.
+  scheduler.add("local-control", localControlTick, HOMEKIT_TASK_URGENT, 0, URGENT_DEADLINE_MS);
+  scheduler.add("relay-timer", relayTimerTick, HOMEKIT_TASK_URGENT);
+  scheduler.add("mqtt", mqttTick, HOMEKIT_TASK_URGENT, 0, URGENT_DEADLINE_MS);
+  scheduler.add("button", buttonTick, HOMEKIT_TASK_URGENT, 0, URGENT_DEADLINE_MS);
+  scheduler.add("bindings", bindingsTick, HOMEKIT_TASK_URGENT);
+  scheduler.add("wifi", []() {
+    if (wifi.tick()) {
+      onWifiConnected();
+    }
+  }, HOMEKIT_TASK_NORMAL);
+  scheduler.add("state", stateTick, HOMEKIT_TASK_BACKGROUND);
 }
 
 void ledTick() {
@@ -162,27 +307,38 @@ void ledTick() {
 
 
 void loop() {
-  if (!client.connected()) {
-    mqttReconnect();
-  }
-
-  client.loop();
-  button.read();
+  scheduler.run();
+}
 
-  if (button.pressedFor(10000)) {
-    Serial.println("Reset Settings");
-    reset();
-  } else if (button.wasReleased()) {
-    Serial.println("Toggle Relay");
-    toggle();
+void buttonTick() {
+  enum HomekitButtonGesture gesture;
+  if (button.poll(gesture)) {
+    if (gesture != HOMEKIT_BUTTON_HOLD) {
+      // Gestures line up with the first binding events.
+      bindings.emit((enum HomekitBindingEvent)gesture);
+    }
+    if (gesture == HOMEKIT_BUTTON_HOLD) {
+      Serial.println("Reset Settings");
+      reset();
+    } else if (gesture == HOMEKIT_BUTTON_SINGLE) {
+      Serial.println("Toggle Relay");
+      toggle();
+    }
   }
 }
 
+// Any change of state cancels a pending timed command, except that with
+// inching enabled, switching on schedules the matching switch off.
 void setState(enum relayState s, bool notify) {
   Serial.printf("Relay State Is %s\n", s == RELAY_STATE_ON ? "On" : "Off");
+  cancelRelayTimer();
+  if (s == RELAY_STATE_ON && inchingMs != 0) {
+    scheduleRelay(RELAY_STATE_OFF, inchingMs);
+  }
   currentState = s;
   digitalWrite(SONOFF_RELAY, s);
   digitalWrite(SONOFF_LED, (s + 1) % 2); // led is active low
+  saveState();
 
   if (notify) {
     notifyState();
@@ -194,16 +350,8 @@ void setState(enum relayState s) {
 }
 
 
-void turnOn() {
-  setState(RELAY_STATE_ON);
-}
-
-void turnOff() {
-  setState(RELAY_STATE_OFF);
-}
-
 void toggle() {
-  setState(currentState == RELAY_STATE_ON ? RELAY_STATE_OFF : RELAY_STATE_ON);
+  setState(oppositeState());
 }
 
 void reboot() {
@@ -213,11 +361,9 @@ void reboot() {
 
 void reset() {
 
-  WMSettings defaults;
+  HomekitSettings defaults;
   settings = defaults;
-  EEPROM.begin(512);
-  EEPROM.put(0, settings);
-  EEPROM.end();
+  settingsStore.clear();
 
   WiFi.disconnect();
   delay(1000);
@@ -226,62 +372,90 @@ void reset() {
 }
 
 
-void onEnterConfigMode (WiFiManager *wifi) {
-  Serial.println("Entered config mode");
-  Serial.println(WiFi.softAPIP());
-  //if you used auto generated SSID, print it
-  Serial.println(wifi->getConfigPortalSSID());
-  //entered config mode, make led toggle faster
-  ticker.attach(0.2, ledTick);
+// Runs once Wi-Fi is up, whether straight away in setup() or later from the
+// portal. Anything entered into the portal is saved here.
+void onWifiConnected() {
+  if (wifi.connected(settingsStore, settings)) {
+    client.setServer(settings.mqttAddress, settings.mqttPort);
+  }
+  startLocalControl();
+  ticker.detach(); // Stop Blinking LED
 }
 
-void onSaveConfig() {
-  Serial.println("Should save config");
-  shouldSaveConfig = true;
+// Catches MQTT up on anything a local or group command changed, once the
+// reply has gone or the group jitter is up.
+void mqttTick() {
+  if (!connection.tick()) {
+    return;
+  }
+  shadowTick();
+  if ((notifyPending || policyNotifyPending) && (long)(millis() - notifyAt) >= 0) {
+    if (notifyPending) {
+      notifyPending = false;
+      notifyState();
+    }
+    if (policyNotifyPending) {
+      policyNotifyPending = false;
+      notifyPowerOnPolicy();
+    }
+  }
 }
 
-void mqttReconnect() {
-  Serial.println("Attempting MQTT connection...");
+bool mqttConnect() {
   // Create a random client ID
   String clientId = "esp-";
   clientId += getPlainMac();
 
   // Attempt to connect. We will setup a will topic publish so that when
   // the device disconnects, it will set it's state to off.
-  if (client.connect(clientId.c_str(), settings.mqttUser, settings.mqttPassword, topicRelayState.c_str(), 0, false, "0")) {
-    Serial.println("Connected to MQTT");
-
-    client.subscribe(topicReboot.c_str());
-    client.subscribe(topicRelaySet.c_str());
-    client.subscribe(topicRepublish.c_str());
-    client.subscribe(topicReset.c_str());
-    Serial.println("Subscribed to topics");
-    notifyState();
-    Serial.println("Notified of current state");
+  if (!client.connect(clientId.c_str(), settings.mqttUser, settings.mqttPassword, topicRelayState.c_str(), 0, false, "0")) {
+    return false;
+  }
+  Serial.println("Connected to MQTT");
+  return true;
+}
 
-  } else {
-    Serial.print("failed, rc=");
-    Serial.print(client.state());
-    Serial.println(" try again in 5 seconds");
-    // Wait 5 seconds before retrying
-    delay(5000);
+void onMqttConnected() {
+  client.subscribe(topicReboot.c_str());
+  client.subscribe(topicRelaySet.c_str());
+  client.subscribe(topicRepublish.c_str());
+  client.subscribe(topicReset.c_str());
+  client.subscribe(topicPowerOnSet.c_str());
+  client.subscribe(topicLocalKeySet.c_str());
+  client.subscribe(topicBindingsSet.c_str());
+  client.subscribe(topicGroupsSet.c_str());
+  client.subscribe(topicShadowDesired.c_str());
+  client.subscribe(topicShadowReported.c_str());
+  client.subscribe(topicTasks.c_str());
+  subscribeGroups(true);
+  Serial.println("Subscribed to topics");
+  if (!bootReported) {
+    publishBootMetrics();
+    bootReported = true;
   }
+  notifyPending = false;
+  policyNotifyPending = false;
+  // The will has just told everyone the relay is off, so that much has to
+  // be put right. The rest only goes out if the shadow on the broker is
+  // out of date, see checkReported().
+  client.publish(topicRelayState.c_str(), currentState == RELAY_STATE_ON ? "1" : "0");
+  shadowReconciled = false;
+  shadowReconcileAt = millis() + SHADOW_RECONCILE_MS;
+  Serial.println("Notified of current state");
 }
 
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
+  if (strncmp(topic, GROUP_TOPIC_PREFIX, sizeof(GROUP_TOPIC_PREFIX) - 1) == 0) {
+    groupCallback(topic + sizeof(GROUP_TOPIC_PREFIX) - 1, payload, length);
+    return;
+  }
   Serial.printf("Message arrived [%s]\n", topic);
 
   if(strcmp(topic, topicReboot.c_str()) == 0) {
     Serial.println("Reboot was requested.");
     reboot();
   } else if (strcmp(topic, topicRelaySet.c_str()) == 0) {
-    if (payload[0] == '1') {
-      Serial.println("Turning on.");
-      turnOn();
-    } else if (payload[0] == '0') {
-      Serial.println("Turning off.");
-      turnOff();
-    } else {
+    if (!runCommand(payload, length, true)) {
       Serial.println("Invalid payload provided.");
     }
   } else if (strcmp(topic, topicRepublish.c_str()) == 0) {
@@ -290,6 +464,20 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
   } else if (strcmp(topic, topicReset.c_str()) == 0) {
     Serial.println("Reset was requested.");
     reset();
+  } else if (strcmp(topic, topicPowerOnSet.c_str()) == 0) {
+    setPowerOnPolicy(payload, length);
+  } else if (strcmp(topic, topicLocalKeySet.c_str()) == 0) {
+    setLocalKey(payload, length);
+  } else if (strcmp(topic, topicBindingsSet.c_str()) == 0) {
+    setBindings(payload, length);
+  } else if (strcmp(topic, topicGroupsSet.c_str()) == 0) {
+    setGroups(payload, length);
+  } else if (strcmp(topic, topicShadowDesired.c_str()) == 0) {
+    applyDesired(payload, length);
+  } else if (strcmp(topic, topicShadowReported.c_str()) == 0) {
+    checkReported(payload, length);
+  } else if (strcmp(topic, topicTasks.c_str()) == 0) {
+    publishTasks();
   }
 }
 
@@ -306,13 +494,498 @@ String getPlainMac(void) {
 
 void makeTopicStrings() {
   String macAddress = getPlainMac();
+  topicPrefix = "device/" + macAddress + "/";
   topicRelayState = "device/" + macAddress + "/relay";
   topicRelaySet = "device/" + macAddress + "/relay/set";
   topicReboot = "device/" + macAddress + "/reboot";
   topicRepublish = "device/" + macAddress + "/republish";
   topicReset = "device/" + macAddress + "/reset";
+  topicMetrics = "device/" + macAddress + "/metrics/";
+  topicPowerOn = "device/" + macAddress + "/power-on";
+  topicPowerOnSet = "device/" + macAddress + "/power-on/set";
+  topicLocalKeySet = "device/" + macAddress + "/local-key/set";
+  topicBindings = "device/" + macAddress + "/bindings";
+  topicBindingsSet = "device/" + macAddress + "/bindings/set";
+  topicGroups = "device/" + macAddress + "/groups";
+  topicGroupsSet = "device/" + macAddress + "/groups/set";
+  topicShadowDesired = "device/" + macAddress + "/shadow/desired";
+  topicShadowReported = "device/" + macAddress + "/shadow/reported";
+  topicTasks = "device/" + macAddress + "/tasks";
 }
 
 void notifyState() {
+  if (groupRequest) {
+    deferNotify();
+    notifyPending = true;
+    return;
+  }
   client.publish(topicRelayState.c_str(), currentState == RELAY_STATE_ON ? "1" : "0");
+  publishReported();
+}
+
+void publishTasks() {
+  homekitPublishTasks(scheduler, publishMetric);
+}
+
+void publishBootMetrics() {
+  homekitPublishBootMetrics(wifi, publishMetric);
+}
+
+void publishMetric(const char *name, const char *value) {
+  client.publish((topicMetrics + name).c_str(), value);
+}
+
+// RTC memory has the latest state after a soft reset, even if it hadn't been
+// written to flash yet; after a power cut, flash has it. Either is read in well
+// under a millisecond.
+void restoreState() {
+  SavedState saved;
+  uint16_t length;
+  bool found = false;
+  memset(&flashState, 0xff, sizeof(flashState));
+  if (stateStore.begin() && stateStore.readLatest(&flashState, sizeof(flashState), length) &&
+      length >= offsetof(SavedState, version)) {
+    if (length < sizeof(flashState)) {
+      flashState.version = 0;
+    }
+    saved = flashState;
+    found = true;
+  }
+  SavedState rtc;
+  if (homekitRtcRead(HOMEKIT_RTC_USER, STATE_RTC_MAGIC, &rtc, sizeof(rtc))) {
+    saved = rtc;
+    found = true;
+  }
+  desiredVersion = found ? saved.version : 0;
+
+  enum relayState s = RELAY_STATE_ON;
+  if (found && saved.policy <= POWER_ON_OFF) {
+    powerOnPolicy = (enum powerOnPolicy)saved.policy;
+    if (powerOnPolicy == POWER_ON_LAST) {
+      s = saved.state ? RELAY_STATE_ON : RELAY_STATE_OFF;
+    }
+  }
+  if (powerOnPolicy == POWER_ON_OFF) {
+    s = RELAY_STATE_OFF;
+  }
+  Serial.printf("Restoring relay state after %lums\n", millis());
+  setState(s, false);
+}
+
+void saveState() {
+  SavedState saved;
+  saved.state = currentState == RELAY_STATE_ON;
+  saved.policy = powerOnPolicy;
+  saved.reserved = 0;
+  saved.version = desiredVersion;
+  homekitRtcWrite(HOMEKIT_RTC_USER, STATE_RTC_MAGIC, &saved, sizeof(saved));
+
+  stateSavePending = memcmp(&saved, &flashState, sizeof(saved)) != 0;
+  stateTick();
+}
+
+void stateTick() {
+  // The rate limit is for a relay switched back and forth. A new desired
+  // version is written straight away: after a power cut, RTC memory is gone
+  // and an older version in flash would apply the retained command again.
+  bool versionChanged = flashState.version != desiredVersion;
+  if (!stateSavePending ||
+      (!versionChanged && lastStateSaveAt != 0 && millis() - lastStateSaveAt < STATE_SAVE_MIN_MS)) {
+    return;
+  }
+
+  flashState.state = currentState == RELAY_STATE_ON;
+  flashState.policy = powerOnPolicy;
+  flashState.reserved = 0;
+  flashState.version = desiredVersion;
+  stateStore.append(&flashState, sizeof(flashState));
+  stateSavePending = false;
+  lastStateSaveAt = millis();
+}
+
+void setPowerOnPolicy(byte* payload, unsigned int length) {
+  if (length == 4 && strncmp((char *)payload, "last", 4) == 0) {
+    powerOnPolicy = POWER_ON_LAST;
+  } else if (length == 2 && strncmp((char *)payload, "on", 2) == 0) {
+    powerOnPolicy = POWER_ON_ON;
+  } else if (length == 3 && strncmp((char *)payload, "off", 3) == 0) {
+    powerOnPolicy = POWER_ON_OFF;
+  } else {
+    Serial.println("Invalid payload provided.");
+    return;
+  }
+  saveState();
+  notifyPowerOnPolicy();
+}
+
+void notifyPowerOnPolicy() {
+  if (groupRequest) {
+    deferNotify();
+    policyNotifyPending = true;
+    return;
+  }
+  const char *policy = powerOnPolicy == POWER_ON_ON ? "on" : powerOnPolicy == POWER_ON_OFF ? "off" : "last";
+  client.publish(topicPowerOn.c_str(), policy);
+  publishReported();
+}
+
+void ICACHE_RAM_ATTR armRelayTimer() {
+  uint32_t ticks = relayTimerRemaining < RELAY_TIMER_CHUNK_TICKS ? relayTimerRemaining : RELAY_TIMER_CHUNK_TICKS;
+  relayTimerRemaining -= ticks;
+  timer1_write(ticks);
+}
+
+// Switches the relay itself, so timed commands land to the millisecond however
+// busy loop() is. relayTimerTick() catches the rest of the state up after.
+void ICACHE_RAM_ATTR onRelayTimer() {
+  if (relayTimerRemaining != 0) {
+    armRelayTimer();
+    return;
+  }
+  timer1_disable();
+  digitalWrite(SONOFF_RELAY, relayTimerTarget);
+  relayTimerPending = false;
+  relayTimerFired = true;
+}
+
+void scheduleRelay(enum relayState s, uint32_t ms) {
+  noInterrupts();
+  timer1_disable();
+  relayTimerTarget = s;
+  relayTimerRemaining = RELAY_TIMER_TICKS(ms);
+  if (relayTimerRemaining == 0) {
+    relayTimerRemaining = 1;
+  }
+  relayTimerPending = true;
+  relayTimerFired = false;
+  timer1_enable(TIM_DIV256, TIM_EDGE, TIM_SINGLE);
+  armRelayTimer();
+  interrupts();
+}
+
+// Also takes over a timer that has fired but not yet been seen by
+// relayTimerTick(), so the stale target isn't applied over whatever the caller
+// does next. currentState is brought up to date with the pin first.
+void cancelRelayTimer() {
+  noInterrupts();
+  timer1_disable();
+  relayTimerPending = false;
+  relayTimerRemaining = 0;
+  if (relayTimerFired) {
+    relayTimerFired = false;
+    currentState = (enum relayState)relayTimerTarget;
+  }
+  interrupts();
+}
+
+// The state a toggle switches to, as the relay is now rather than as loop()
+// last saw it.
+enum relayState oppositeState() {
+  cancelRelayTimer();
+  return currentState == RELAY_STATE_ON ? RELAY_STATE_OFF : RELAY_STATE_ON;
+}
+
+void relayTimerTick() {
+  if (!relayTimerFired) {
+    return;
+  }
+  relayTimerFired = false;
+  Serial.println("Timed command finished");
+  setState((enum relayState)relayTimerTarget);
+}
+
+// Everything relay/set accepts, shared by MQTT and local control. With notify
+// false the new state isn't published, so the caller can answer first.
+bool runCommand(byte* payload, unsigned int length, bool notify) {
+  if (length != 0 && payload[0] == '1') {
+    Serial.println("Turning on.");
+    setState(RELAY_STATE_ON, notify);
+  } else if (length != 0 && payload[0] == '0') {
+    Serial.println("Turning off.");
+    setState(RELAY_STATE_OFF, notify);
+  } else if (length == 6 && strncmp((char *)payload, "toggle", 6) == 0) {
+    Serial.println("Toggling.");
+    setState(oppositeState(), notify);
+  } else {
+    return runRelayCommand(payload, length, notify);
+  }
+  return true;
+}
+
+// Timed commands on relay/set, each taking a duration in ms:
+//   "on <ms>"      switch on now, and off again after ms
+//   "off <ms>"     switch off now, and on again after ms
+//   "pulse <ms>"   flip now, and flip back after ms
+//   "inching <ms>" from now on, switch off ms after every switch on (0 stops)
+bool runRelayCommand(byte* payload, unsigned int length, bool notify) {
+  char command[24];
+  char action[8];
+  unsigned long ms;
+  if (length >= sizeof(command)) {
+    return false;
+  }
+  memcpy(command, payload, length);
+  command[length] = '\0';
+  if (sscanf(command, "%7s %lu", action, &ms) != 2 || ms > RELAY_TIMER_MAX_MS) {
+    return false;
+  }
+
+  if (strcmp(action, "inching") == 0) {
+    Serial.printf("Inching %s\n", ms != 0 ? "enabled" : "disabled");
+    inchingMs = ms;
+    return true;
+  }
+
+  enum relayState s;
+  if (strcmp(action, "on") == 0) {
+    s = RELAY_STATE_ON;
+  } else if (strcmp(action, "off") == 0) {
+    s = RELAY_STATE_OFF;
+  } else if (strcmp(action, "pulse") == 0) {
+    s = oppositeState();
+  } else {
+    return false;
+  }
+
+  Serial.printf("Turning %s for %lums\n", s == RELAY_STATE_ON ? "on" : "off", ms);
+  setState(s, notify);
+  scheduleRelay(s == RELAY_STATE_ON ? RELAY_STATE_OFF : RELAY_STATE_ON, ms);
+  return true;
+}
+
+// Modem sleep can hold a datagram back for a whole DTIM interval, a few
+// hundred ms, so the radio is kept awake while local control is on. Bindings
+// are signed with the same key, so they start and stop along with it.
+void startLocalControl() {
+  bindings.start(settings.localKey);
+  if (localControlActive) {
+    localControl.stop();
+    localControlActive = false;
+  }
+  if (settings.localKey[0] == '\0') {
+    WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+    return;
+  }
+
+  localControlBoot = random(1, 0x7fffffff);
+  localControlSequence = 0;
+  localControl.begin(LOCAL_CONTROL_PORT);
+  WiFi.setSleepMode(WIFI_NONE_SLEEP);
+  localControlActive = true;
+  Serial.printf("Local control on UDP port %u\n", LOCAL_CONTROL_PORT);
+}
+
+// Takes at most one datagram per pass through loop(), and answers it before
+// anything else happens: the new state goes back in the reply, and out to MQTT
+// on the next mqttTick(). Anything without a valid tag is dropped unanswered.
+void localControlTick() {
+  if (!localControlActive || localControl.parsePacket() == 0) {
+    return;
+  }
+
+  uint8_t packet[sizeof(LocalControlHeader) + LOCAL_CONTROL_MAX_COMMAND + HOMEKIT_AUTH_TAG_SIZE];
+  int length = localControl.read(packet, sizeof(packet));
+  if (length < (int)(sizeof(LocalControlHeader) + HOMEKIT_AUTH_TAG_SIZE)) {
+    return;
+  }
+
+  LocalControlHeader header;
+  memcpy(&header, packet, sizeof(header));
+  length -= HOMEKIT_AUTH_TAG_SIZE;
+  if (header.magic != LOCAL_CONTROL_MAGIC || header.version != LOCAL_CONTROL_VERSION ||
+      !homekitAuthVerify(settings.localKey, packet, length, packet + length)) {
+    Serial.println("Dropped unauthenticated local control request");
+    return;
+  }
+  if (header.boot != localControlBoot || header.sequence <= localControlSequence) {
+    replyLocalControl(LOCAL_CONTROL_STALE, localControlSequence);
+    return;
+  }
+  localControlSequence = header.sequence;
+
+  byte* command = packet + sizeof(header);
+  unsigned int commandLength = length - sizeof(header);
+  enum localControlStatus status = LOCAL_CONTROL_OK;
+  if (commandLength != 3 || strncmp((char *)command, "get", 3) != 0) {
+    if (runCommand(command, commandLength, false)) {
+      if (!notifyPending && !policyNotifyPending) {
+        notifyAt = millis();
+      }
+      notifyPending = true;
+    } else {
+      status = LOCAL_CONTROL_INVALID;
+    }
+  }
+  replyLocalControl(status, header.sequence);
+}
+
+void replyLocalControl(enum localControlStatus status, uint32_t sequence) {
+  uint8_t packet[sizeof(LocalControlHeader) + 1 + HOMEKIT_AUTH_TAG_SIZE];
+  LocalControlHeader header;
+  header.magic = LOCAL_CONTROL_MAGIC;
+  header.version = LOCAL_CONTROL_VERSION;
+  header.status = status;
+  header.boot = localControlBoot;
+  header.sequence = sequence;
+  memcpy(packet, &header, sizeof(header));
+  packet[sizeof(header)] = currentState == RELAY_STATE_ON ? '1' : '0';
+  homekitAuthSign(settings.localKey, packet, sizeof(header) + 1, packet + sizeof(header) + 1);
+
+  localControl.beginPacket(localControl.remoteIP(), localControl.remotePort());
+  localControl.write(packet, sizeof(packet));
+  localControl.endPacket();
+}
+
+// Sets the local control key over the (TLS) broker connection. An empty
+// payload turns local control off.
+void setLocalKey(byte* payload, unsigned int length) {
+  if (!settingsStore.saveLocalKey(settings, (char *)payload, length)) {
+    Serial.println("Invalid payload provided.");
+    return;
+  }
+  startLocalControl();
+}
+
+// See HomekitBindings for the format.
+void setBindings(byte* payload, unsigned int length) {
+  char buff[80];
+  bindings.configure((char *)payload, length, buff, sizeof(buff));
+  updateDoublePressWindow();
+  client.publish(topicBindings.c_str(), buff);
+}
+
+// Toggling shouldn't wait to see if a second press is coming, unless a
+// double press has a binding to send.
+void updateDoublePressWindow() {
+  button.setDoublePressWindow(bindings.sends(HOMEKIT_BINDING_DOUBLE) ? HOMEKIT_BUTTON_DOUBLE_MS : 0);
+}
+
+// Applies frames from other devices' buttons and rules straight away. The
+// new state reaches MQTT as usual, so it still shows the final state.
+void bindingsTick() {
+  enum HomekitBindingAction action;
+  if (!bindings.poll(action)) {
+    return;
+  }
+  Serial.println("Binding received");
+  if (action == HOMEKIT_BINDING_TOGGLE) {
+    toggle();
+  } else {
+    setState(action == HOMEKIT_BINDING_ON ? RELAY_STATE_ON : RELAY_STATE_OFF);
+  }
+}
+
+// Takes a list of group names separated by spaces or commas (see
+// HomekitGroups.h), or nothing to leave every group, and replies on groups
+// with the groups we're in.
+void setGroups(byte* payload, unsigned int length) {
+  if (!homekitGroupsConfigure((char *)payload, length, settingsStore, settings, subscribeGroups)) {
+    Serial.println("Invalid payload provided.");
+  }
+  client.publish(topicGroups.c_str(), settings.groups);
+}
+
+void subscribeGroups(bool subscribe) {
+  homekitGroupsSubscribe(client, GROUP_TOPIC_PREFIX, settings.groups, "#", subscribe);
+}
+
+// Group commands go through mqttCallback() as if they'd been sent to us
+// alone, and take effect straight away. Only the replies are held back, see
+// deferNotify().
+void groupCallback(const char* topic, byte* payload, unsigned int length) {
+  const char *suffix = strchr(topic, '/');
+  if (suffix == NULL || !homekitGroupsContain(settings.groups, topic, suffix - topic)) {
+    return;
+  }
+  suffix++;
+  if (strcmp(suffix, "relay/set") != 0 && strcmp(suffix, "republish") != 0 &&
+      strcmp(suffix, "power-on/set") != 0) {
+    Serial.printf("Ignoring group topic [%s]\n", topic);
+    return;
+  }
+
+  String deviceTopic = topicPrefix + suffix;
+  groupRequest = true;
+  mqttCallback((char *)deviceTopic.c_str(), payload, length);
+  groupRequest = false;
+}
+
+// Replies to a group command wait a random delay, so a whole group answering
+// reaches the broker spread out rather than in the same moment.
+void deferNotify() {
+  if (!notifyPending && !policyNotifyPending) {
+    notifyAt = millis() + random(HOMEKIT_GROUP_JITTER_MS + 1);
+  }
+}
+
+// shadow/desired is a retained "<version> <command>", where the command is
+// anything relay/set accepts and the version goes up with every change. It
+// is applied once: a version no newer than the last one applied is stale,
+// whether it's the retained copy coming back on reconnect or a command that
+// was overtaken while we were offline.
+void applyDesired(byte* payload, unsigned int length) {
+  char buff[32];
+  if (length >= sizeof(buff)) {
+    Serial.println("Invalid payload provided.");
+    return;
+  }
+  memcpy(buff, payload, length);
+  buff[length] = '\0';
+
+  char *command;
+  unsigned long version = strtoul(buff, &command, 10);
+  if (command == buff || *command != ' ') {
+    Serial.println("Invalid payload provided.");
+    return;
+  }
+  if (version <= desiredVersion) {
+    Serial.printf("Ignoring stale desired state, version %lu\n", version);
+    return;
+  }
+
+  // Even a command that doesn't parse uses its version up, or it would be
+  // retried on every reconnect.
+  desiredVersion = version;
+  command++;
+  if (!runCommand((byte *)command, strlen(command), false)) {
+    Serial.println("Invalid desired state.");
+  }
+  saveState();
+  notifyState();
+}
+
+// shadow/reported is a retained "<version> <relay> <power-on policy>", with
+// the last desired version applied. The broker hands its copy back when we
+// subscribe, and it's only published again if that's out of date.
+void checkReported(byte* payload, unsigned int length) {
+  if (shadowReconciled) {
+    return;
+  }
+  char buff[32];
+  size_t used = formatReported(buff, sizeof(buff));
+  if (length == used && memcmp(payload, buff, used) == 0) {
+    Serial.println("Shadow is up to date");
+    shadowReconciled = true;
+  } else {
+    publishReported();
+  }
+}
+
+size_t formatReported(char* buff, size_t size) {
+  const char *policy = powerOnPolicy == POWER_ON_ON ? "on" : powerOnPolicy == POWER_ON_OFF ? "off" : "last";
+  return snprintf(buff, size, "%u %c %s", desiredVersion, currentState == RELAY_STATE_ON ? '1' : '0', policy);
+}
+
+void publishReported() {
+  char buff[32];
+  formatReported(buff, sizeof(buff));
+  client.publish(topicShadowReported.c_str(), buff, true);
+  shadowReconciled = true;
+}
+
+// Nothing retained came back, so there's no shadow on the broker yet.
+void shadowTick() {
+  if (!shadowReconciled && (long)(millis() - shadowReconcileAt) >= 0) {
+    publishReported();
+  }
 }
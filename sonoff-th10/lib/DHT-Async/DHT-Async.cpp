@@ -0,0 +1,137 @@
+#include "DHT-Async.h"
+
+// Response low/high, 40 bits of low/high, and the final release.
+#define DHT_ASYNC_EXPECTED_EDGES 84
+// High pulses are ~26us for a 0 and ~70us for a 1.
+#define DHT_ASYNC_ONE_THRESHOLD_US 48
+
+// Interrupt handlers can't be bound to an instance, so as with Homekit we keep
+// a pointer to the (only) sensor around for the static trampoline.
+static DHTAsync *g_DHTAsyncInstance;
+
+DHTAsync::DHTAsync(uint8_t pin, unsigned long interval) {
+  this->pin = pin;
+  this->interval = interval < DHT_ASYNC_MIN_INTERVAL ? DHT_ASYNC_MIN_INTERVAL : interval;
+  g_DHTAsyncInstance = this;
+}
+
+// Pass settled when the sensor has been powered for a while already (e.g. on
+// waking from deep sleep) to start the first conversion straight away.
+void DHTAsync::begin(bool settled) {
+  pinMode(pin, INPUT_PULLUP);
+  // Otherwise give it its power-up settling time first.
+  lastStart = settled ? millis() - interval : millis();
+}
+
+void DHTAsync::poll() {
+  switch (phase) {
+    case DHT_ASYNC_IDLE:
+      if (millis() - lastStart < interval) {
+        return;
+      }
+      lastStart = millis();
+      pinMode(pin, OUTPUT);
+      digitalWrite(pin, LOW);
+      phaseStart = micros();
+      phase = DHT_ASYNC_WAKING;
+      return;
+
+    case DHT_ASYNC_WAKING:
+      if (micros() - phaseStart < DHT_ASYNC_WAKE_US) {
+        return;
+      }
+      edgeCount = 0;
+      pinMode(pin, INPUT_PULLUP);
+      attachInterrupt(digitalPinToInterrupt(pin), DHTAsync::_onEdge, CHANGE);
+      phaseStart = micros();
+      phase = DHT_ASYNC_RECEIVING;
+      return;
+
+    case DHT_ASYNC_RECEIVING:
+      if (edgeCount < DHT_ASYNC_EXPECTED_EDGES && micros() - phaseStart < DHT_ASYNC_TIMEOUT_US) {
+        return;
+      }
+      detachInterrupt(digitalPinToInterrupt(pin));
+      phase = DHT_ASYNC_IDLE;
+      if (!decode()) {
+        failed++;
+      }
+      return;
+  }
+}
+
+const DHTReading &DHTAsync::reading() {
+  return cached;
+}
+
+unsigned long DHTAsync::age() {
+  return millis() - cached.takenAt;
+}
+
+uint32_t DHTAsync::failures() {
+  return failed;
+}
+
+bool DHTAsync::decode() {
+  uint8_t count = edgeCount;
+  uint8_t widths[DHT_ASYNC_MAX_EDGES / 2];
+  uint8_t highs = 0;
+
+  // Measure every high pulse. The data bits are the last 40 of them, which
+  // skips the response pulse and anything caught while the line settled.
+  for (uint8_t i = 0; i + 1 < count; i++) {
+    bool high = edgeLevels[i / 8] & (1 << (i % 8));
+    bool nextHigh = edgeLevels[(i + 1) / 8] & (1 << ((i + 1) % 8));
+    if (high && !nextHigh) {
+      uint16_t width = edgeTimes[i + 1] - edgeTimes[i];
+      widths[highs++] = width > 255 ? 255 : width;
+    }
+  }
+
+  if (highs < 40) {
+    Serial.printf("DHT read failed, only saw %u bits\n", highs);
+    return false;
+  }
+
+  uint8_t data[5] = {0, 0, 0, 0, 0};
+  uint8_t first = highs - 40;
+  for (uint8_t i = 0; i < 40; i++) {
+    data[i / 8] <<= 1;
+    if (widths[first + i] > DHT_ASYNC_ONE_THRESHOLD_US) {
+      data[i / 8] |= 1;
+    }
+  }
+
+  if (((data[0] + data[1] + data[2] + data[3]) & 0xFF) != data[4]) {
+    Serial.println("DHT read failed, checksum mismatch");
+    return false;
+  }
+
+  // The sensor reports tenths.
+  cached.humidity = ((data[0] << 8) | data[1]) * 10;
+  cached.temperature = (((data[2] & 0x7F) << 8) | data[3]) * 10;
+  if (data[2] & 0x80) {
+    cached.temperature = -cached.temperature;
+  }
+  cached.takenAt = millis();
+  cached.valid = true;
+  return true;
+}
+
+void ICACHE_RAM_ATTR DHTAsync::onEdge() {
+  uint8_t i = edgeCount;
+  if (i >= DHT_ASYNC_MAX_EDGES) {
+    return;
+  }
+  edgeTimes[i] = micros();
+  if (digitalRead(pin)) {
+    edgeLevels[i / 8] |= (1 << (i % 8));
+  } else {
+    edgeLevels[i / 8] &= ~(1 << (i % 8));
+  }
+  edgeCount = i + 1;
+}
+
+void ICACHE_RAM_ATTR DHTAsync::_onEdge() {
+  g_DHTAsyncInstance->onEdge();
+}
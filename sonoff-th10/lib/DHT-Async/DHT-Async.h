@@ -0,0 +1,65 @@
+#ifndef DHT_ASYNC_H_
+#define DHT_ASYNC_H_
+
+#include <Arduino.h>
+
+// The sensor needs at least 2 seconds between conversions.
+#define DHT_ASYNC_MIN_INTERVAL  2000
+// DHT21/22 only need the line held low for ~1ms to wake up.
+#define DHT_ASYNC_WAKE_US       1100
+// 40 data bits take at most ~5ms; anything longer is a failed read.
+#define DHT_ASYNC_TIMEOUT_US    10000
+// Two edges per bit, plus the response pulses and a little slack.
+#define DHT_ASYNC_MAX_EDGES     96
+
+enum DHTAsyncPhase {
+  DHT_ASYNC_IDLE,
+  DHT_ASYNC_WAKING,
+  DHT_ASYNC_RECEIVING,
+};
+
+// Values are fixed point, in hundredths of a %RH and hundredths of a degree
+// Celsius, so nothing between the sensor and the MQTT payload needs floats.
+struct DHTReading {
+  int16_t humidity;
+  int16_t temperature;
+  unsigned long takenAt;
+  bool valid;
+};
+
+// A non-blocking driver for the DHT21/AM2301 (and DHT22). Instead of bit
+// banging with interrupts disabled, the wake-up pulse is timed from poll()
+// and the reply is captured by a pin change interrupt that timestamps each
+// edge, so nothing here ever blocks loop().
+//
+// Call poll() as often as possible; a conversion is started every interval
+// ms and the most recent good reading is kept in a cache.
+class DHTAsync {
+  public:
+    DHTAsync(uint8_t pin, unsigned long interval = DHT_ASYNC_MIN_INTERVAL);
+    void begin(bool settled = false);
+    void poll();
+
+    const DHTReading &reading();
+    unsigned long age();
+    uint32_t failures();
+
+  private:
+    uint8_t pin;
+    unsigned long interval;
+    enum DHTAsyncPhase phase = DHT_ASYNC_IDLE;
+    unsigned long lastStart = 0;
+    unsigned long phaseStart = 0;
+    uint32_t failed = 0;
+    DHTReading cached = {0, 0, 0, false};
+
+    volatile uint8_t edgeCount;
+    volatile uint16_t edgeTimes[DHT_ASYNC_MAX_EDGES];
+    volatile uint8_t edgeLevels[DHT_ASYNC_MAX_EDGES / 8];
+
+    bool decode();
+    void onEdge();
+    static void _onEdge();
+};
+
+#endif /* DHT_ASYNC_H_ */
@@ -5,11 +5,48 @@
 // methods.
 static Homekit *g_HomekitInstance;
 
-Homekit::Homekit(uint8_t buttonPin, uint8_t ledPin, uint16_t eepromSalt) {
+#ifdef HOMEKIT_COUNT_ALLOCATIONS
+// Built with -Wl,--wrap=malloc (and calloc/realloc), every heap allocation in
+// the firmware passes through here and is counted.
+static volatile uint32_t g_HomekitAllocations = 0;
+
+extern "C" {
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t count, size_t size);
+  void *__real_realloc(void *ptr, size_t size);
+
+  void *__wrap_malloc(size_t size) {
+    g_HomekitAllocations++;
+    return __real_malloc(size);
+  }
+
+  void *__wrap_calloc(size_t count, size_t size) {
+    g_HomekitAllocations++;
+    return __real_calloc(count, size);
+  }
+
+  void *__wrap_realloc(void *ptr, size_t size) {
+    g_HomekitAllocations++;
+    return __real_realloc(ptr, size);
+  }
+}
+
+uint32_t Homekit::allocations() {
+  return g_HomekitAllocations;
+}
+#else
+uint32_t Homekit::allocations() {
+  return 0;
+}
+#endif
+
+Homekit::Homekit(uint8_t buttonPin, uint8_t ledPin, uint16_t eepromSalt) :
+    button(buttonPin), writeBuffer(espClient), client(writeBuffer), connection(client) {
   init(buttonPin, ledPin, eepromSalt);
 }
 
-Homekit::Homekit(uint8_t buttonPin, uint8_t ledPin, uint16_t eepromSalt, String willTopic, char * willMsg) {
+Homekit::Homekit(uint8_t buttonPin, uint8_t ledPin, uint16_t eepromSalt, String willTopic, char * willMsg) :
+    button(buttonPin), writeBuffer(espClient), client(writeBuffer), connection(client) {
   init(buttonPin, ledPin, eepromSalt);
 
   this->willTopic = willTopic;
@@ -19,106 +56,323 @@ Homekit::Homekit(uint8_t buttonPin, uint8_t ledPin, uint16_t eepromSalt, String
 void Homekit::init(uint8_t buttonPin, uint8_t ledPin,  uint16_t eepromSalt) {
   macAddress = getPlainMac();
   hostname = "esp-" + macAddress;
-  this->client = new PubSubClient(espClient);
-  this->button = new Button(buttonPin, false, true, 20);
   this->ledPin = ledPin;
   this->eepromSalt = eepromSalt;
 
+  // Until something asks for double presses.
+  button.setDoublePressWindow(0);
+
+  topicPrefixLength = snprintf(topicBuffer, sizeof(topicBuffer), "esp/%s/", macAddress.c_str());
+
   g_HomekitInstance = this;
 }
 
-String Homekit::makeTopicString(String topic) {
-  return "esp/" + macAddress + "/" + topic;
+// Builds "esp/<mac>/<topic>" in place after the prefix, which is written into
+// topicBuffer once by init(). The result is only valid until the next call.
+const char *Homekit::makeTopic(const char *topic) {
+  size_t length = strlen(topic);
+  if (topicPrefixLength + length >= sizeof(topicBuffer)) {
+    Serial.printf("Topic too long, dropping: %s\n", topic);
+    return NULL;
+  }
+  memcpy(topicBuffer + topicPrefixLength, topic, length + 1);
+  return topicBuffer;
 }
 
 void Homekit::beginConfig() {
   pinMode(ledPin, OUTPUT);
+  button.begin();
+
+  // Handle Config Params. Firmware from before the settings store kept them
+  // in EEPROM, validated with eepromSalt.
+  bool configured = settingsStore.begin() &&
+      (settingsStore.load(settings) || settingsStore.migrateEeprom(HOMEKIT_LEGACY_HOMEKIT, eepromSalt, settings));
+  if (!configured) {
+    Serial.println("No saved settings, trying with defaults");
+    HomekitSettings defaults;
+    settings = defaults;
+    WiFi.disconnect();
+  }
 
-  WiFiManager wifiManager;
-  wifiManager.setAPCallback(Homekit::_onEnterConfigMode);
-  wifiManager.setConfigPortalTimeout(180); //Reboot if it's not configured.
+  // Entering config mode makes the LED blink faster.
+  wifi.begin(settings, [this]() {
+    ticker.attach(0.2, Homekit::_tickLED);
+  });
+  bindings.begin();
+  updateDoublePressWindow();
+  bool online = wifi.connect(hostname.c_str(), configured);
 
-  // Handle Config Params
-  EEPROM.begin(512);
-  EEPROM.get(0, settings);
-  EEPROM.end();
+  Serial.println("Device is started...");
+  if (online) {
+    onWifiConnected();
+  }
 
-  if (settings.eepromSalt != eepromSalt) {
-    Serial.println("Invalid settings in EEPROM, trying with defaults");
-    WMSettings defaults;
-    settings = defaults;
-    settings.eepromSalt = eepromSalt;
-    WiFi.disconnect();
+  subscribeTo(TOPIC_REBOOT, std::bind(&Homekit::reboot, this));
+  subscribeTo(TOPIC_RESET, std::bind(&Homekit::reset, this));
+  subscribeTo(TOPIC_BACKLOG_ACK, std::bind(&Homekit::acknowledgeBacklog, this,
+                                           std::placeholders::_1, std::placeholders::_2));
+  subscribeTo(TOPIC_BINDINGS_SET, std::bind(&Homekit::setBindings, this,
+                                            std::placeholders::_1, std::placeholders::_2));
+  subscribeTo(TOPIC_LOCAL_KEY_SET, std::bind(&Homekit::setLocalKey, this,
+                                             std::placeholders::_1, std::placeholders::_2));
+  subscribeTo(TOPIC_GROUPS_SET, std::bind(&Homekit::setGroups, this,
+                                          std::placeholders::_1, std::placeholders::_2));
+  subscribeTo(TOPIC_TASKS, std::bind(&Homekit::publishTasks, this));
+
+  // Commands arrive through the urgent tasks, so they run between every other
+  // task. Flushing is one of them so replies don't wait on the rest of a pass.
+  scheduler.add("mqtt", [this]() { connection.tick(); }, HOMEKIT_TASK_URGENT, 0, HOMEKIT_URGENT_DEADLINE_MS);
+  scheduler.add("button", std::bind(&Homekit::buttonTick, this), HOMEKIT_TASK_URGENT, 0, HOMEKIT_URGENT_DEADLINE_MS);
+  scheduler.add("bindings", std::bind(&Homekit::bindingsTick, this), HOMEKIT_TASK_URGENT);
+  scheduler.add("flush", std::bind(&Homekit::flushWrites, this), HOMEKIT_TASK_URGENT);
+  scheduler.add("group-replies", std::bind(&Homekit::sendGroupReplies, this), HOMEKIT_TASK_NORMAL);
+  scheduler.add("wifi", [this]() {
+    if (wifi.tick()) {
+      onWifiConnected();
+    }
+  }, HOMEKIT_TASK_NORMAL);
+  scheduler.add("backlog", std::bind(&Homekit::drainBacklog, this), HOMEKIT_TASK_BACKGROUND);
+
+  // Queued messages are stamped with the wall clock time when it's known.
+  configTime(0, 0, "pool.ntp.org");
+  if (!queue.begin()) {
+    Serial.println("Flash queue unavailable, messages will be lost while offline");
   }
 
-  WiFiManagerParameter mqttServerAddress("mqtt-server-address", "MQTT Server Address", settings.mqttAddress, 30);
-  WiFiManagerParameter mqttServerPort("mqtt-server-port", "MQTT Server Port", String(settings.mqttPort).c_str(), 6);
-  WiFiManagerParameter mqttUsername("mqtt-username", "MQTT User", settings.mqttUser, 16);
-  WiFiManagerParameter mqttPassword("mqtt-password", "MQTT Password", settings.mqttPassword, 16);
-  wifiManager.addParameter(&mqttServerAddress);
-  wifiManager.addParameter(&mqttServerPort);
-  wifiManager.addParameter(&mqttUsername);
-  wifiManager.addParameter(&mqttPassword);
+  restoreTlsSession();
+  espClient.setSession(&tlsSession);
+  espClient.setTimeout(HOMEKIT_CONNECT_TIMEOUT_MS);
 
-  //set config save notify callback
-  wifiManager.setSaveConfigCallback(Homekit::_onSaveConfig);
+  client.setServer(settings.mqttAddress, settings.mqttPort);
+  client.setCallback(Homekit::_mqttCallback);
+  connection.begin(std::bind(&Homekit::mqttConnect, this), std::bind(&Homekit::onMqttConnected, this));
+}
 
-  if (!wifiManager.autoConnect(hostname.c_str())) {
-    Serial.println("failed to connect and hit timeout");
-    reboot();
+// Runs one pass of the scheduler: Homekit's own tasks, added in beginConfig(),
+// and any the firmware added with addTask().
+void Homekit::tick() {
+  scheduler.run();
+}
+
+int8_t Homekit::addTask(const char *name, HOMEKIT_TASK_SIGNATURE task, enum HomekitTaskPriority priority,
+                        unsigned long interval, unsigned long deadline) {
+  return scheduler.add(name, task, priority, interval, deadline);
+}
+
+void Homekit::buttonTick() {
+  enum HomekitButtonGesture gesture;
+  if (button.poll(gesture)) {
+    if (gesture == HOMEKIT_BUTTON_HOLD) {
+      Serial.println("Reset Settings");
+      reset();
+    } else {
+      // Gestures line up with the first binding events.
+      bindings.emit((enum HomekitBindingEvent)gesture);
+      if (onButtonPressCallbacks[gesture] != NULL) {
+        onButtonPressCallbacks[gesture]();
+      }
+    }
   }
+}
 
-  if (shouldSaveConfig) {
-    Serial.println("Saving config");
+void Homekit::bindingsTick() {
+  enum HomekitBindingAction action;
+  if (bindings.poll(action) && onBindingCallback != NULL) {
+    onBindingCallback(action);
+  }
+}
 
-    strcpy(settings.mqttAddress, mqttServerAddress.getValue());
-    strcpy(settings.mqttUser, mqttUsername.getValue());
-    strcpy(settings.mqttPassword, mqttPassword.getValue());
-    settings.mqttPort = atoi(mqttServerPort.getValue());
+// Packets published by a task are held in writeBuffer and sent together here,
+// once the oldest has waited flushDeadline ms (0, the default, sends them
+// after every task).
+void Homekit::flushWrites() {
+  if (writeBuffer.pending() == 0) {
+    return;
+  }
+  if (millis() - writeBuffer.pendingSince() >= flushDeadline) {
+    writeBuffer.flush();
+  }
+}
 
-    EEPROM.begin(512);
-    EEPROM.put(0, settings);
-    EEPROM.end();
+// Sends the oldest queued messages to "backlog" as one message: a batch id on
+// the first line, then "<unix time> <topic> <payload>" per line. They stay
+// in flash until the id is echoed back on "backlog/ack", so only one batch
+// is outstanding at a time.
+void Homekit::drainBacklog() {
+  if (!connection.connected() || !queue.pending()) {
+    return;
+  }
+  if (backlogInFlight && millis() - backlogSentAt < HOMEKIT_BACKLOG_ACK_TIMEOUT_MS) {
+    return;
   }
 
-  ticker.detach(); // Stop Blinking LED
-  Serial.println("Device is started...");
-  Serial.printf("settings.mqttAddress: '%s'\n", settings.mqttAddress);
-  Serial.printf("settings.mqttPort: '%d'\n", settings.mqttPort);
-  Serial.printf("settings.mqttUser: '%s'\n", settings.mqttUser);
-  Serial.printf("settings.mqttPassword: '%s'\n", settings.mqttPassword);
+  char batch[HOMEKIT_BACKLOG_BATCH];
+  backlogId++;
+  int header = snprintf(batch, sizeof(batch), "%u\n", backlogId);
+  if (queue.buildBatch(batch + header, sizeof(batch) - header) == 0) {
+    return;
+  }
 
+  const char *topic = makeTopic(TOPIC_BACKLOG);
+  if (topic == NULL || !client.publish(topic, batch)) {
+    Serial.println("Failed to publish backlog batch");
+  }
+  backlogSentAt = millis();
+  backlogInFlight = true;
+}
 
-  subscribeTo(TOPIC_REBOOT, std::bind(&Homekit::reboot, this));
-  subscribeTo(TOPIC_RESET, std::bind(&Homekit::reset, this));
+// See HomekitBindings for the format.
+void Homekit::setBindings(char * payload, unsigned int length) {
+  char buff[80];
+  bindings.configure(payload, length, buff, sizeof(buff));
+  updateDoublePressWindow();
+  publish(TOPIC_BINDINGS, buff);
+}
 
-  client->setServer(settings.mqttAddress, settings.mqttPort);
-  client->setCallback(Homekit::_mqttCallback);
+// The key bindings are signed with, shared by every device they run between.
+// An empty payload turns bindings off.
+void Homekit::setLocalKey(char * payload, unsigned int length) {
+  if (!settingsStore.saveLocalKey(settings, payload, length)) {
+    Serial.println("Invalid payload provided.");
+    return;
+  }
+  bindings.start(settings.localKey);
 }
 
-void Homekit::tick() {
-  if (!client->connected()) {
-    mqttReconnect();
-  }
-
-  client->loop();
-  button->read();
-  if (button->pressedFor(10000)) {
-    Serial.println("Reset Settings");
-    reset();
-  } else if (button->wasReleased()) {
-    if (onButtonPressCallback != NULL) {
-      onButtonPressCallback();
-    }
+// Takes a list of group names separated by spaces or commas (see
+// HomekitGroups.h), or nothing to leave every group, and replies on "groups"
+// with the groups we're in.
+void Homekit::setGroups(char * payload, unsigned int length) {
+  if (!homekitGroupsConfigure(payload, length, settingsStore, settings,
+                              std::bind(&Homekit::subscribeGroups, this, std::placeholders::_1))) {
+    Serial.println("Invalid payload provided.");
+  }
+  publish(TOPIC_GROUPS, settings.groups);
+}
+
+// Subscribes to (or unsubscribes from) the group topics for every group we're
+// in, the same way as our own topics.
+void Homekit::subscribeGroups(bool subscribe) {
+#if HOMEKIT_WILDCARD_SUBSCRIBE
+  homekitGroupsSubscribe(client, HOMEKIT_GROUP_PREFIX, settings.groups, "#", subscribe);
+#else
+  for (uint8_t i = 0; i < router.size(); i++) {
+    homekitGroupsSubscribe(client, HOMEKIT_GROUP_PREFIX, settings.groups, router.pattern(i), subscribe);
+  }
+#endif
+}
+
+// A command sent to a whole group goes through the same routes as one sent to
+// us alone, and runs straight away. Whatever it publishes is held back for a
+// random delay, so the group's replies reach the broker spread out instead of
+// all at once. Everything else, keepalives included, goes out as usual.
+void Homekit::groupCallback(const char * topic, char * payload, unsigned int length) {
+  const char *suffix = strchr(topic, '/');
+  if (suffix == NULL || !homekitGroupsContain(settings.groups, topic, suffix - topic)) {
+    return;
+  }
+  suffix++;
+  // Never what anyone means to send to a whole group.
+  if (strcmp(suffix, TOPIC_RESET) == 0) {
+    Serial.println("Ignoring reset sent to a group");
+    return;
+  }
+
+  handlingGroupCommand = true;
+  if (router.dispatch(suffix, payload, length)) {
+    Serial.printf("Group message arrived [%s]\n", topic);
+  }
+  handlingGroupCommand = false;
+}
+
+// Keeps a message published while handling a group command for
+// sendGroupReplies(), which sends it after a random delay so a whole group
+// doesn't answer at once. Returns false if it should go out now instead.
+bool Homekit::deferGroupReply(const char * fullTopic, const uint8_t * data, unsigned int length) {
+  if (!handlingGroupCommand) {
+    return false;
   }
+  uint16_t topicLength = strlen(fullTopic) + 1;
+  if (groupRepliesLength + 2 * sizeof(uint16_t) + topicLength + length > sizeof(groupReplies)) {
+    Serial.println("No room to hold a group reply back, sending it now");
+    return false;
+  }
+
+  if (groupRepliesLength == 0) {
+    groupRepliesAt = millis() + random(HOMEKIT_GROUP_JITTER_MS + 1);
+  }
+  uint16_t payloadLength = length;
+  uint8_t *p = groupReplies + groupRepliesLength;
+  memcpy(p, &topicLength, sizeof(topicLength));
+  p += sizeof(topicLength);
+  memcpy(p, fullTopic, topicLength);
+  p += topicLength;
+  memcpy(p, &payloadLength, sizeof(payloadLength));
+  p += sizeof(payloadLength);
+  memcpy(p, data, length);
+  groupRepliesLength = p + length - groupReplies;
+  return true;
+}
+
+void Homekit::sendGroupReplies() {
+  if (groupRepliesLength == 0 || (long)(millis() - groupRepliesAt) < 0) {
+    return;
+  }
+
+  uint16_t offset = 0;
+  while (offset < groupRepliesLength) {
+    uint16_t topicLength;
+    uint16_t payloadLength;
+    memcpy(&topicLength, groupReplies + offset, sizeof(topicLength));
+    const char *fullTopic = (const char *)groupReplies + offset + sizeof(topicLength);
+    offset += sizeof(topicLength) + topicLength;
+    memcpy(&payloadLength, groupReplies + offset, sizeof(payloadLength));
+    offset += sizeof(payloadLength);
+    client.publish(fullTopic, groupReplies + offset, payloadLength);
+    offset += payloadLength;
+  }
+  groupRepliesLength = 0;
+}
+
+void Homekit::acknowledgeBacklog(char * payload, unsigned int length) {
+  int32_t id;
+  if (!backlogInFlight || !parseFixed(payload, length, 0, id) || (uint32_t)id != backlogId) {
+    return;
+  }
+  queue.acknowledge();
+  backlogInFlight = false;
+}
+
+bool Homekit::configPortalActive() {
+  return wifi.portalActive();
+}
+
+bool Homekit::connected() {
+  return connection.connected();
+}
+
+// Runs once Wi-Fi is up, whether straight away in beginConfig() or later from
+// the portal. Anything entered into the portal is saved here.
+void Homekit::onWifiConnected() {
+  if (wifi.connected(settingsStore, settings)) {
+    client.setServer(settings.mqttAddress, settings.mqttPort);
+  }
+  bindings.start(settings.localKey);
+  ticker.detach(); // Stop Blinking LED
+}
+
+void Homekit::setFlushDeadline(unsigned long ms) {
+  flushDeadline = ms;
 }
 
 void Homekit::subscribeTo(String topic, HOMEKIT_CALLBACK_SIGNATURE callback) {
-  Subscription *sub = new Subscription;
-  sub->cb = callback;
-  sub->topic = makeTopicString(topic);
-  sub->next = subscriptions;
-  subscriptions = sub;
+  route(topic.c_str(), [callback](const HomekitParams &params, char *payload, unsigned int length) {
+    callback(payload, length);
+  });
+}
+
+void Homekit::route(const char *pattern, HOMEKIT_ROUTE_SIGNATURE callback) {
+  router.add(pattern, callback);
 }
 
 void Homekit::onConnect(ON_CONNECT_SIGNATURE fn) {
@@ -126,9 +380,34 @@ void Homekit::onConnect(ON_CONNECT_SIGNATURE fn) {
 }
 
 void Homekit::onButtonPress(ON_BUTTON_PRESS_SIGNATURE fn) {
-  onButtonPressCallback = fn;
+  onButtonPress(HOMEKIT_BUTTON_SINGLE, fn);
+}
+
+// Single presses are only held back to wait for a possible second press once
+// something is listening for double presses.
+void Homekit::onButtonPress(enum HomekitButtonGesture gesture, ON_BUTTON_PRESS_SIGNATURE fn) {
+  if (gesture == HOMEKIT_BUTTON_HOLD) {
+    return;
+  }
+  onButtonPressCallbacks[gesture] = fn;
+  updateDoublePressWindow();
 }
 
+// A double press can set off a binding too, even with no callback for it.
+void Homekit::updateDoublePressWindow() {
+  bool wanted = onButtonPressCallbacks[HOMEKIT_BUTTON_DOUBLE] != NULL || bindings.sends(HOMEKIT_BINDING_DOUBLE);
+  button.setDoublePressWindow(wanted ? HOMEKIT_BUTTON_DOUBLE_MS : 0);
+}
+
+
+void Homekit::onBinding(ON_BINDING_SIGNATURE fn) {
+  onBindingCallback = fn;
+}
+
+// For events that don't come from the button, e.g. the rule engine.
+bool Homekit::emitBinding(enum HomekitBindingEvent event) {
+  return bindings.emit(event);
+}
 
 void Homekit::reboot() {
   ESP.reset();
@@ -136,11 +415,9 @@ void Homekit::reboot() {
 }
 
 void Homekit::reset() {
-  WMSettings defaults;
+  HomekitSettings defaults;
   settings = defaults;
-  EEPROM.begin(512);
-  EEPROM.put(0, settings);
-  EEPROM.end();
+  settingsStore.clear();
 
   WiFi.disconnect();
   delay(1000);
@@ -148,6 +425,23 @@ void Homekit::reset() {
   delay(2000);
 }
 
+// Sends anything still buffered and disconnects cleanly (so the broker doesn't
+// publish our will) before sleeping. GPIO16 must be wired to RST for the
+// device to wake up again. Waking with the radio off saves its calibration
+// and power when the next wake doesn't need the network.
+void Homekit::deepSleep(unsigned long ms, bool radio) {
+  if (connection.connected()) {
+    writeBuffer.flush();
+    client.disconnect();
+  }
+  ESP.deepSleep((uint64_t)ms * 1000, radio ? WAKE_RF_DEFAULT : WAKE_RF_DISABLED);
+}
+
+// True while queued messages are waiting to be sent or acknowledged.
+bool Homekit::backlogPending() {
+  return queue.pending();
+}
+
 String Homekit::getPlainMac(void) {
   byte mac[6];
   WiFi.macAddress(mac);
@@ -159,19 +453,85 @@ String Homekit::getPlainMac(void) {
 }
 
 
-void Homekit::publish(String topic, char * data) {
-  if (topic != NULL && data != NULL) {
-      client->publish(makeTopicString(topic).c_str(), data);
+void Homekit::publish(String topic, const char * data) {
+  if (topic != NULL) {
+    publish(topic.c_str(), data);
+  }
+}
+
+void Homekit::publish(const char * topic, const char * data) {
+  if (topic == NULL || data == NULL) {
+    return;
+  }
+
+#ifdef HOMEKIT_COUNT_ALLOCATIONS
+  uint32_t before = allocations();
+#endif
+
+  const char *fullTopic = makeTopic(topic);
+  if (fullTopic != NULL && !deferGroupReply(fullTopic, (const uint8_t *)data, strlen(data))) {
+    client.publish(fullTopic, data);
+  }
+
+#ifdef HOMEKIT_COUNT_ALLOCATIONS
+  uint32_t used = allocations() - before;
+  if (used != 0) {
+    Serial.printf("publish(%s) made %u heap allocations\n", topic, used);
+  }
+#endif
+}
+
+void Homekit::publish(const char * topic, const uint8_t * data, unsigned int length) {
+  if (topic == NULL || data == NULL) {
+    return;
+  }
+  const char *fullTopic = makeTopic(topic);
+  if (fullTopic != NULL && !deferGroupReply(fullTopic, data, length)) {
+    client.publish(fullTopic, data, length);
+  }
+}
+
+// Like publish(), but if the broker can't be reached the message is queued in
+// flash and delivered later in a batch on "backlog", along with the time it
+// was originally published. Delivery is at least once: a batch whose ack is
+// lost will be sent again.
+void Homekit::publishDurable(const char * topic, const char * data) {
+  if (topic == NULL || data == NULL) {
+    return;
   }
+
+  // Anything already queued has to go first to keep messages in order.
+  if (connection.connected() && !queue.pending()) {
+    const char *fullTopic = makeTopic(topic);
+    if (fullTopic != NULL && (deferGroupReply(fullTopic, (const uint8_t *)data, strlen(data)) ||
+                              client.publish(fullTopic, data))) {
+      return;
+    }
+  }
+  queue.push(topic, data);
+}
+
+void Homekit::publishDurable(const char * topic, int32_t value, uint8_t decimals) {
+  char buff[13];
+  if (formatFixed(buff, sizeof(buff), value, decimals) != 0) {
+    publishDurable(topic, buff);
+  }
+}
+
+// Publishes a fixed point value, e.g. 2150 with 2 decimals as "21.50".
+void Homekit::publish(const char * topic, int32_t value, uint8_t decimals) {
+  char buff[13];
+  if (formatFixed(buff, sizeof(buff), value, decimals) != 0) {
+    publish(topic, buff);
+  }
+}
+
+size_t Homekit::formatFixed(char *buffer, size_t size, int32_t value, uint8_t decimals) {
+  return homekitFormatFixed(buffer, size, value, decimals);
 }
 
-void Homekit::onEnterConfigMode(WiFiManager *wifi) {
-  Serial.println("Entered config mode");
-  Serial.println(WiFi.softAPIP());
-  //if you used auto generated SSID, print it
-  Serial.println(wifi->getConfigPortalSSID());
-  //entered config mode, make led toggle faster
-  g_HomekitInstance->ticker.attach(0.2, Homekit::_tickLED);
+bool Homekit::parseFixed(const char *str, unsigned int length, uint8_t decimals, int32_t &value) {
+  return homekitParseFixed(str, length, decimals, value);
 }
 
 void Homekit::tickLED() {
@@ -180,72 +540,174 @@ void Homekit::tickLED() {
   digitalWrite(g_HomekitInstance->ledPin, !state);     // set pin to the opposite state
 }
 
-void Homekit::onSaveConfig() {
-  Serial.println("Should save config");
-  g_HomekitInstance->shouldSaveConfig = true;
-}
+// Connects with TLS, resuming the last session if the broker still has it.
+bool Homekit::mqttConnect() {
+  configureTls();
+
+  // BearSSL keeps the session ID when it resumes, so if it's unchanged after
+  // connecting we skipped the full handshake.
+  br_ssl_session_parameters *session = tlsSession.getSession();
+  uint8_t previousIdLength = session->session_id_len;
+  uint8_t previousId[sizeof(session->session_id)];
+  memcpy(previousId, session->session_id, sizeof(previousId));
+  uint32_t heapBefore = ESP.getFreeHeap();
+  unsigned long started = millis();
+
+  // Attempt to connect. We will setup a will topic publish so that when
+  // the device disconnects, it will set it's state to off. CONNECT has to go
+  // out immediately since connect() waits on the CONNACK.
+  writeBuffer.setPassthrough(true);
+  bool result;
+  if (willTopic != NULL && willMsg != NULL) {
+    result = client.connect(hostname.c_str(), settings.mqttUser, settings.mqttPassword,
+                             willTopic.c_str(), 0, false, (char *)willMsg);
+  } else {
+    result = client.connect(hostname.c_str(), settings.mqttUser, settings.mqttPassword);
+  }
+  writeBuffer.setPassthrough(false);
 
-void Homekit::mqttReconnect() {
+  if (!result) {
+    return false;
+  }
 
-  while(!client->connected()) {
-    Serial.println("Attempting MQTT connection...");
-    // Attempt to connect. We will setup a will topic publish so that when
-    // the device disconnects, it will set it's state to off.
-    bool result;
-    if (willTopic != NULL && willMsg != NULL) {
-      result = client->connect(hostname.c_str(), settings.mqttUser, settings.mqttPassword,
-                               willTopic.c_str(), 0, false, (char *)willMsg);
-    } else {
-      client->connect(hostname.c_str(), settings.mqttUser, settings.mqttPassword);
+  connectElapsed = millis() - started;
+  connectHeapUsed = heapBefore - ESP.getFreeHeap();
+  connectResumed = previousIdLength != 0 && session->session_id_len == previousIdLength &&
+                   memcmp(previousId, session->session_id, previousIdLength) == 0;
+  Serial.printf("Connected to MQTT in %lums (TLS session %s)\n", connectElapsed, connectResumed ? "resumed" : "new");
+
+  if (!connectResumed) {
+    saveTlsSession();
+  }
+  return true;
+}
+
+void Homekit::onMqttConnected() {
+  // Whatever was in flight on the old connection is sent again.
+  backlogInFlight = false;
+
+#if HOMEKIT_WILDCARD_SUBSCRIBE
+  const char *topic = makeTopic("#");
+  Serial.printf("Subscribed to topic: %s\n", topic);
+  client.subscribe(topic);
+#else
+  for (uint8_t i = 0; i < router.size(); i++) {
+    const char *topic = makeTopic(router.pattern(i));
+    if (topic != NULL) {
+      Serial.printf("Subscribed to topic: %s\n", topic);
+      client.subscribe(topic);
     }
+  }
+#endif
+  subscribeGroups(true);
+  Serial.println("Subscribed to topics");
 
-    if (result) {
-      Serial.println("Connected to MQTT");
+  if (!bootReported) {
+    publishBootMetrics();
+    bootReported = true;
+  }
+  publishConnectMetrics();
 
-      for(Subscription *curr = subscriptions; curr != NULL; curr = curr->next) {
-        Serial.println("Subscribed to topic: " + curr->topic);
-        client->subscribe(curr->topic.c_str());
-      }
-      Serial.println("Subscribed to topics");
+  if (onConnectCallback != NULL) {
+    Serial.println("Executing on-connect callback");
+    onConnectCallback();
+  }
+  Serial.println("Notified of current state");
+}
 
-      if (onConnectCallback != NULL) {
-        Serial.println("Executing on-connect callback");
-        onConnectCallback();
-      }
-      Serial.println("Notified of current state");
-    } else {
-      Serial.print("failed, rc=");
-      Serial.print(client->state());
-      Serial.println(" try again in 5 seconds");
-      // Wait 5 seconds before retrying
-      delay(5000);
-    }
+// The negotiated TLS session is kept in RTC memory, so that reconnecting after
+// a soft reboot (reboot(), a crash, the watchdog) can resume it rather than
+// paying for a full handshake.
+void Homekit::restoreTlsSession() {
+  uint32_t blocks[(sizeof(br_ssl_session_parameters) + 3) / 4];
+  static_assert(sizeof(blocks) + 8 <= HOMEKIT_RTC_TLS_SESSION_BLOCKS * 4, "TLS session does not fit its RTC slot");
+  if (homekitRtcRead(HOMEKIT_RTC_TLS_SESSION, HOMEKIT_RTC_TLS_SESSION_MAGIC, blocks, sizeof(blocks))) {
+    memcpy(tlsSession.getSession(), blocks, sizeof(br_ssl_session_parameters));
+    Serial.println("Restored TLS session from RTC memory");
   }
 }
 
-void Homekit::mqttCallback(char *topic, byte *payload, unsigned int length) {
-  Serial.printf("Message arrived [%s]\n", topic);
+void Homekit::saveTlsSession() {
+  uint32_t blocks[(sizeof(br_ssl_session_parameters) + 3) / 4];
+  memset(blocks, 0, sizeof(blocks));
+  memcpy(blocks, tlsSession.getSession(), sizeof(br_ssl_session_parameters));
+  homekitRtcWrite(HOMEKIT_RTC_TLS_SESSION, HOMEKIT_RTC_TLS_SESSION_MAGIC, blocks, sizeof(blocks));
+}
 
-  for(Subscription *curr = subscriptions; curr != NULL; curr = curr->next) {
-    if (curr->topic.compareTo(topic) == 0) {
-      Serial.println("Matching subscribed topic string: " + curr->topic);
-      curr->cb((char *)payload, length);
-      return;
-    }
+void Homekit::setTlsProfile(enum HomekitTlsProfile profile) {
+  tlsProfile = profile;
+}
+
+// Probing costs an extra TCP connection and half a handshake, so it's done
+// once per boot, on the first connect attempt, and the choice sticks even if
+// the broker was unreachable then.
+void Homekit::configureTls() {
+  if (tlsProfile == HOMEKIT_TLS_DEFAULT || tlsProbed) {
+    return;
+  }
+  tlsProbed = true;
+
+  uint16_t length = tlsProfile == HOMEKIT_TLS_MINIMAL ? 512 : 1024;
+  if (espClient.probeMaxFragmentLength(settings.mqttAddress, settings.mqttPort, length)) {
+    Serial.printf("Broker supports %u byte TLS fragments\n", length);
+    espClient.setBufferSizes(length, length);
+    tlsFragmentLength = length;
+  } else {
+    Serial.println("Broker did not accept a max fragment length, using default TLS buffers");
   }
-  Serial.println("Topic does not have a handler");
 }
 
-void Homekit::_tickLED() {
-  g_HomekitInstance->tickLED();
+void Homekit::publishConnectMetrics() {
+  char buff[11];
+  snprintf(buff, sizeof(buff), "%lu", connectElapsed);
+  publish("metrics/connect-ms", buff);
+  publish("metrics/tls-resumed", connectResumed ? "1" : "0");
+
+  snprintf(buff, sizeof(buff), "%u", connectHeapUsed);
+  publish("metrics/tls-heap-used", buff);
+  // Relative to BearSSL's default 16K receive buffer.
+  snprintf(buff, sizeof(buff), "%u", tlsFragmentLength != 0 ? 16384 - tlsFragmentLength : 0);
+  publish("metrics/tls-heap-saved", buff);
+
+  snprintf(buff, sizeof(buff), "%u", queue.dropped());
+  publish("metrics/backlog-dropped", buff);
+}
+
+void Homekit::publishTasks() {
+  homekitPublishTasks(scheduler, std::bind(&Homekit::publishMetric, this, std::placeholders::_1, std::placeholders::_2));
+}
+
+void Homekit::publishBootMetrics() {
+  homekitPublishBootMetrics(wifi, std::bind(&Homekit::publishMetric, this, std::placeholders::_1, std::placeholders::_2));
 }
 
-void Homekit::_onEnterConfigMode(WiFiManager *wifi) {
-  g_HomekitInstance->onEnterConfigMode(wifi);
+void Homekit::publishMetric(const char *name, const char *value) {
+  char topic[HOMEKIT_MAX_TOPIC];
+  snprintf(topic, sizeof(topic), "metrics/%s", name);
+  publish(topic, value);
 }
 
-void Homekit::_onSaveConfig() {
-  g_HomekitInstance->onSaveConfig();
+void Homekit::mqttCallback(char *topic, byte *payload, unsigned int length) {
+  if (strncmp(topic, HOMEKIT_GROUP_PREFIX, sizeof(HOMEKIT_GROUP_PREFIX) - 1) == 0) {
+    groupCallback(topic + sizeof(HOMEKIT_GROUP_PREFIX) - 1, (char *)payload, length);
+    return;
+  }
+
+  // Strip the "esp/<mac>/" prefix, leaving the suffix routes are keyed on.
+  if (strncmp(topic, topicBuffer, topicPrefixLength) != 0) {
+    Serial.printf("Ignoring foreign topic [%s]\n", topic);
+    return;
+  }
+
+  // With a wildcard subscription the broker echoes our own publishes back
+  // to us, so unrouted topics are expected and dropped quietly.
+  if (router.dispatch(topic + topicPrefixLength, (char *)payload, length)) {
+    Serial.printf("Message arrived [%s]\n", topic);
+  }
+}
+
+void Homekit::_tickLED() {
+  g_HomekitInstance->tickLED();
 }
 
 void Homekit::_mqttCallback(char *topic, byte *payload, unsigned int length) {
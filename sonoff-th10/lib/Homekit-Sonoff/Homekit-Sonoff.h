@@ -2,33 +2,78 @@
 #define HOMEKIT_SONOFF_H_
 
 #include <Ticker.h>
-#include <Button.h>
 #include <ESP8266WiFi.h>
 #include <PubSubClient.h>
 #include <WiFiManager.h>
-#include <EEPROM.h>
 #include <Arduino.h>
+#include "HomekitRouter.h"
+#include "HomekitWriteBuffer.h"
+#include "HomekitRtc.h"
+#include "HomekitQueue.h"
+#include "HomekitSettings.h"
+#include "HomekitButton.h"
+#include "HomekitBindings.h"
+#include "HomekitGroups.h"
+#include "HomekitScheduler.h"
+#include "HomekitWifi.h"
+#include "HomekitMetrics.h"
+#include "HomekitConnection.h"
+#include "HomekitFixed.h"
 
 #define TOPIC_REBOOT  "reboot"
 #define TOPIC_RESET   "reset"
+#define TOPIC_BACKLOG     "backlog"
+#define TOPIC_BACKLOG_ACK "backlog/ack"
+#define TOPIC_BINDINGS      "bindings"
+#define TOPIC_BINDINGS_SET  "bindings/set"
+#define TOPIC_LOCAL_KEY_SET "local-key/set"
+#define TOPIC_GROUPS        "groups"
+#define TOPIC_GROUPS_SET    "groups/set"
+#define TOPIC_TASKS         "tasks"
+
+// Group topics are "esp/group/<name>/<suffix>", with the same suffixes as a
+// device's own topics.
+#define HOMEKIT_GROUP_PREFIX "esp/group/"
+// Room for the replies to group commands while they wait out their jitter.
+// Any that don't fit go out straight away.
+#define HOMEKIT_GROUP_REPLY_BUFFER 256
+
+// Subscribe once to "esp/<mac>/#" and route everything locally. Set to 0 to
+// fall back to one SUBSCRIBE per route, which avoids receiving our own
+// publishes back from the broker at the cost of a round-trip per route on
+// every reconnect.
+#ifndef HOMEKIT_WILDCARD_SUBSCRIBE
+#define HOMEKIT_WILDCARD_SUBSCRIBE 1
+#endif
+
+// Longest full topic, "esp/<mac>/" included, that publish() can build.
+#define HOMEKIT_MAX_TOPIC 64
+
+// Largest batch of queued messages sent to "backlog" at once. PubSubClient has
+// to be built with a MQTT_MAX_PACKET_SIZE big enough for it plus the topic.
+#define HOMEKIT_BACKLOG_BATCH 384
+// Resend a batch if "backlog/ack" hasn't confirmed it within this long.
+#define HOMEKIT_BACKLOG_ACK_TIMEOUT_MS 10000
+
+// How long the MQTT client and the button can go unpolled before it counts
+// against their deadline in the task stats.
+#define HOMEKIT_URGENT_DEADLINE_MS 50
+
+#define HOMEKIT_RTC_TLS_SESSION_MAGIC 0x544c5331 // "TLS1"
 
 #define HOMEKIT_CALLBACK_SIGNATURE std::function<void(char *, unsigned int)>
 #define ON_CONNECT_SIGNATURE std::function<void(void)>
 #define ON_BUTTON_PRESS_SIGNATURE ON_CONNECT_SIGNATURE
-
-class Subscription {
-  public:
-    HOMEKIT_CALLBACK_SIGNATURE cb;
-    String topic;
-    Subscription *next;
-};
-
-struct WMSettings {
-  uint16_t eepromSalt = 0x00;
-  char mqttAddress[30] = "";
-  char mqttUser[17] = "";
-  char mqttPassword[17] = "";
-  int mqttPort = 8883;
+#define ON_BINDING_SIGNATURE std::function<void(enum HomekitBindingAction)>
+
+// How much RAM to give BearSSL. The reduced profiles negotiate a smaller
+// maximum fragment length (RFC 6066) with the broker so the 16K receive
+// buffer can shrink to match, and fall back to the defaults when the broker
+// doesn't support it.
+enum HomekitTlsProfile {
+  HOMEKIT_TLS_DEFAULT,
+  HOMEKIT_TLS_REDUCED,  // 1024 byte fragments
+  HOMEKIT_TLS_MINIMAL,  // 512 byte fragments
 };
 
 class Homekit {
@@ -37,26 +82,48 @@ class Homekit {
     Homekit(uint8_t buttonPin, uint8_t ledPin, uint16_t eeprom_salt, String willTopic, char * willMsg);
     void beginConfig();
     void tick();
+    int8_t addTask(const char *name, HOMEKIT_TASK_SIGNATURE task, enum HomekitTaskPriority priority,
+                   unsigned long interval = 0, unsigned long deadline = 0);
+    void setFlushDeadline(unsigned long ms);
+    void setTlsProfile(enum HomekitTlsProfile profile);
+    bool configPortalActive();
+    bool connected();
 
     void onConnect(ON_CONNECT_SIGNATURE callback);
     void onButtonPress(ON_BUTTON_PRESS_SIGNATURE callback);
+    void onButtonPress(enum HomekitButtonGesture gesture, ON_BUTTON_PRESS_SIGNATURE callback);
+    void onBinding(ON_BINDING_SIGNATURE callback);
+    bool emitBinding(enum HomekitBindingEvent event);
 
     void subscribeTo(String topic, HOMEKIT_CALLBACK_SIGNATURE callback);
-    void publish(String topic, char * data);
+    void route(const char *pattern, HOMEKIT_ROUTE_SIGNATURE callback);
+    void publish(String topic, const char * data);
+    void publish(const char * topic, const char * data);
+    void publish(const char * topic, int32_t value, uint8_t decimals);
+    void publish(const char * topic, const uint8_t * data, unsigned int length);
+    void publishDurable(const char * topic, const char * data);
+    void publishDurable(const char * topic, int32_t value, uint8_t decimals);
 
     void reboot();
     void reset();
+    void deepSleep(unsigned long ms, bool radio);
+    bool backlogPending();
 
     static String getPlainMac(void);
+    static uint32_t allocations();
+    static size_t formatFixed(char *buffer, size_t size, int32_t value, uint8_t decimals);
+    static bool parseFixed(const char *str, unsigned int length, uint8_t decimals, int32_t &value);
     String hostname;
     String macAddress;
 
   private:
     Ticker ticker;
-    Button* button;
+    HomekitButton button;
 
     WiFiClientSecure espClient;
-    PubSubClient* client;
+    BearSSL::Session tlsSession;
+    HomekitWriteBuffer writeBuffer;
+    PubSubClient client;
 
     uint8_t buttonPin;
     uint8_t ledPin;
@@ -64,15 +131,65 @@ class Homekit {
     String willTopic;
     char * willMsg;
 
-    bool shouldSaveConfig = false;
 
-    Subscription * subscriptions;
-    struct WMSettings settings;
+    HomekitConnection connection;
+    // How the last connect went, for publishConnectMetrics().
+    unsigned long connectElapsed = 0;
+    bool connectResumed = false;
+    uint32_t connectHeapUsed = 0;
+    unsigned long flushDeadline = 0;
+    // Replies to group commands, as <topic length> <topic> <length> <payload>
+    // records, sent at groupRepliesAt. See groupCallback().
+    uint8_t groupReplies[HOMEKIT_GROUP_REPLY_BUFFER];
+    uint16_t groupRepliesLength = 0;
+    unsigned long groupRepliesAt = 0;
+    bool handlingGroupCommand = false;
+
+    enum HomekitTlsProfile tlsProfile = HOMEKIT_TLS_DEFAULT;
+    uint16_t tlsFragmentLength = 0;
+    bool tlsProbed = false;
+
+    HomekitRouter router;
+    HomekitQueue queue;
+    HomekitWifi wifi;
+    bool bootReported = false;
+    uint32_t backlogId = 0;
+    unsigned long backlogSentAt = 0;
+    bool backlogInFlight = false;
+
+    HomekitSettingsStore settingsStore;
+    HomekitSettings settings;
+    HomekitBindings bindings;
+    HomekitScheduler scheduler;
 
     ON_CONNECT_SIGNATURE onConnectCallback;
-    ON_BUTTON_PRESS_SIGNATURE onButtonPressCallback;
-
-    void mqttReconnect();
+    // Indexed by gesture. Holding the button always resets.
+    ON_BUTTON_PRESS_SIGNATURE onButtonPressCallbacks[HOMEKIT_BUTTON_HOLD];
+    ON_BINDING_SIGNATURE onBindingCallback;
+
+    bool mqttConnect();
+    void onMqttConnected();
+    void flushWrites();
+    void buttonTick();
+    void bindingsTick();
+    void publishTasks();
+    void drainBacklog();
+    void acknowledgeBacklog(char * payload, unsigned int length);
+    void setBindings(char * payload, unsigned int length);
+    void setLocalKey(char * payload, unsigned int length);
+    void updateDoublePressWindow();
+    void setGroups(char * payload, unsigned int length);
+    void subscribeGroups(bool subscribe);
+    void groupCallback(const char * topic, char * payload, unsigned int length);
+    bool deferGroupReply(const char * fullTopic, const uint8_t * data, unsigned int length);
+    void sendGroupReplies();
+    void restoreTlsSession();
+    void saveTlsSession();
+    void configureTls();
+    void publishConnectMetrics();
+    void publishBootMetrics();
+    void publishMetric(const char *name, const char *value);
+    void onWifiConnected();
 
     void mqttCallback(char * topic, byte * payload, unsigned int length);
     static void _mqttCallback(char * topic, byte * payload, unsigned int length);
@@ -80,14 +197,10 @@ class Homekit {
     void tickLED();
     static void _tickLED();
 
-    void onEnterConfigMode(WiFiManager *wifi);
-    static void _onEnterConfigMode(WiFiManager *wifi);
-
-    void onSaveConfig();
-    static void _onSaveConfig();
-
     void init(uint8_t buttonPin, uint8_t ledPin, uint16_t eepromSalt);
-    String makeTopicString(String topic);
+    char topicBuffer[HOMEKIT_MAX_TOPIC];
+    uint8_t topicPrefixLength;
+    const char *makeTopic(const char *topic);
 };
 
 
@@ -0,0 +1,22 @@
+#include "HomekitAuth.h"
+#include <bearssl/bearssl_hmac.h>
+
+void homekitAuthSign(const char *key, const void *data, size_t length, uint8_t *tag) {
+  br_hmac_key_context keyContext;
+  br_hmac_context context;
+  br_hmac_key_init(&keyContext, &br_sha256_vtable, key, strlen(key));
+  br_hmac_init(&context, &keyContext, HOMEKIT_AUTH_TAG_SIZE);
+  br_hmac_update(&context, data, length);
+  br_hmac_out(&context, tag);
+}
+
+bool homekitAuthVerify(const char *key, const void *data, size_t length, const uint8_t *tag) {
+  uint8_t expected[HOMEKIT_AUTH_TAG_SIZE];
+  homekitAuthSign(key, data, length, expected);
+
+  uint8_t difference = 0;
+  for (uint8_t i = 0; i < HOMEKIT_AUTH_TAG_SIZE; i++) {
+    difference |= expected[i] ^ tag[i];
+  }
+  return difference == 0;
+}
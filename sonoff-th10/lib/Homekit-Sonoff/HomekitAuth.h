@@ -0,0 +1,17 @@
+#ifndef HOMEKIT_AUTH_H_
+#define HOMEKIT_AUTH_H_
+
+#include <Arduino.h>
+
+// Tags are HMAC-SHA256 truncated to 128 bits, which is plenty for messages
+// that are only accepted once.
+#define HOMEKIT_AUTH_TAG_SIZE 16
+
+// Signs and checks datagrams sent outside of the TLS connection to the broker,
+// with a key shared between the devices and whatever talks to them. The tag
+// covers the first length bytes of data.
+void homekitAuthSign(const char *key, const void *data, size_t length, uint8_t *tag);
+// Compares in constant time, so a forger can't learn the tag a byte at a time.
+bool homekitAuthVerify(const char *key, const void *data, size_t length, const uint8_t *tag);
+
+#endif /* HOMEKIT_AUTH_H_ */
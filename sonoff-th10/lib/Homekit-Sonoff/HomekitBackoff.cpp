@@ -0,0 +1,29 @@
+#include "HomekitBackoff.h"
+
+HomekitBackoff::HomekitBackoff(unsigned long min, unsigned long max) {
+  this->min = min;
+  this->max = max;
+  backoff = min;
+}
+
+unsigned long HomekitBackoff::schedule() {
+  // Wait somewhere between half and all of the current backoff, so that a
+  // fleet of devices which lost the broker at the same moment don't all come
+  // back at the same moment. The ESP8266 hardware RNG makes this per-device.
+  unsigned long wait = backoff / 2 + random(backoff / 2 + 1);
+  nextAttemptAt = millis() + wait;
+
+  backoff = backoff * 2;
+  if (backoff > max) {
+    backoff = max;
+  }
+  return wait;
+}
+
+bool HomekitBackoff::due() {
+  return (long)(millis() - nextAttemptAt) >= 0;
+}
+
+void HomekitBackoff::reset() {
+  backoff = min;
+}
@@ -0,0 +1,29 @@
+#ifndef HOMEKIT_BACKOFF_H_
+#define HOMEKIT_BACKOFF_H_
+
+#include <Arduino.h>
+
+// Bounds for the jittered exponential backoff between MQTT connection
+// attempts.
+#define HOMEKIT_RECONNECT_MIN_MS  1000
+#define HOMEKIT_RECONNECT_MAX_MS  60000
+
+// Spaces out reconnection attempts, doubling the wait after every failure up
+// to a limit.
+class HomekitBackoff {
+  public:
+    HomekitBackoff(unsigned long min = HOMEKIT_RECONNECT_MIN_MS, unsigned long max = HOMEKIT_RECONNECT_MAX_MS);
+    // Call after a failed attempt. Returns how long until the next one.
+    unsigned long schedule();
+    bool due();
+    // Call after a successful attempt.
+    void reset();
+
+  private:
+    unsigned long min;
+    unsigned long max;
+    unsigned long backoff;
+    unsigned long nextAttemptAt = 0;
+};
+
+#endif /* HOMEKIT_BACKOFF_H_ */
@@ -0,0 +1,285 @@
+#include "HomekitBindings.h"
+#include <ESP8266WiFi.h>
+#include <time.h>
+
+// As in HomekitQueue, anything earlier means the clock hasn't been set.
+#define HOMEKIT_BINDINGS_VALID_TIME 1500000000
+
+// Longest configuration text configure() takes.
+#define HOMEKIT_BINDINGS_MAX_TEXT 256
+
+static const char *g_HomekitBindingEvents[HOMEKIT_BINDING_EVENTS] = {
+  "single", "double", "long", "rule-on", "rule-off",
+};
+
+static const char *g_HomekitBindingActions[] = {
+  "on", "off", "toggle",
+};
+
+static int8_t homekitBindingLookup(const char *word, const char **names, uint8_t count) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (strcmp(word, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+HomekitBindings::HomekitBindings() : ring(HOMEKIT_FLASH_BINDINGS, HOMEKIT_FLASH_BINDINGS_SECTORS) {
+  memset(&table, 0, sizeof(table));
+  memset(senders, 0, sizeof(senders));
+}
+
+// Loads the bindings from flash. They do nothing until start().
+bool HomekitBindings::begin() {
+  uint16_t length;
+  if (!ring.begin()) {
+    return false;
+  }
+  if (!ring.readLatest(&table, sizeof(table), length) || length != sizeof(table) ||
+      table.count > HOMEKIT_MAX_BINDINGS) {
+    memset(&table, 0, sizeof(table));
+  }
+  return true;
+}
+
+// Joins the multicast group once Wi-Fi is up. key must stay valid for as long
+// as the bindings are used; an empty one turns them off.
+void HomekitBindings::start(const char *key) {
+  this->key = key;
+  if (listening) {
+    udp.stop();
+    listening = false;
+  }
+  if (key[0] == '\0') {
+    return;
+  }
+  udp.beginMulticast(WiFi.localIP(), HOMEKIT_BINDINGS_GROUP, HOMEKIT_BINDINGS_PORT);
+  listening = true;
+}
+
+// Replaces every binding with those in text, or leaves them alone and sets
+// error() if it doesn't parse. Empty text removes them all.
+bool HomekitBindings::configure(const char *text, unsigned int length) {
+  char buffer[HOMEKIT_BINDINGS_MAX_TEXT];
+  if (length >= sizeof(buffer)) {
+    errorMessage = "too long";
+    return false;
+  }
+  memcpy(buffer, text, length);
+  buffer[length] = '\0';
+
+  HomekitBinding parsed[HOMEKIT_MAX_BINDINGS];
+  uint8_t parsedCount = 0;
+  char *statementState;
+  for (char *statement = strtok_r(buffer, ";\n", &statementState); statement != NULL;
+       statement = strtok_r(NULL, ";\n", &statementState)) {
+    char *words[5];
+    uint8_t wordCount = 0;
+    char *wordState;
+    for (char *word = strtok_r(statement, " \t\r", &wordState); word != NULL && wordCount < 5;
+         word = strtok_r(NULL, " \t\r", &wordState)) {
+      words[wordCount++] = word;
+    }
+    if (wordCount == 0) {
+      continue;
+    }
+    if (parsedCount == HOMEKIT_MAX_BINDINGS) {
+      errorMessage = "too many bindings";
+      return false;
+    }
+
+    HomekitBinding &binding = parsed[parsedCount];
+    memset(&binding, 0, sizeof(binding));
+    const char *group;
+    if (strcmp(words[0], "send") == 0 && wordCount == 4) {
+      int8_t event = homekitBindingLookup(words[1], g_HomekitBindingEvents, HOMEKIT_BINDING_EVENTS);
+      int8_t action = homekitBindingLookup(words[3], g_HomekitBindingActions, 3);
+      if (event < 0) {
+        errorMessage = "unknown event";
+        return false;
+      }
+      if (action < 0) {
+        errorMessage = "unknown action";
+        return false;
+      }
+      binding.type = HOMEKIT_BINDING_SEND;
+      binding.event = event;
+      binding.action = action;
+      group = words[2];
+    } else if (strcmp(words[0], "receive") == 0 && wordCount == 2) {
+      binding.type = HOMEKIT_BINDING_RECEIVE;
+      group = words[1];
+    } else {
+      errorMessage = "expected send <event> <group> <action> or receive <group>";
+      return false;
+    }
+
+    char *end;
+    unsigned long value = strtoul(group, &end, 10);
+    if (*end != '\0' || value == 0 || value > 0xffff) {
+      errorMessage = "group must be 1 to 65535";
+      return false;
+    }
+    binding.group = value;
+    parsedCount++;
+  }
+
+  memcpy(table.bindings, parsed, sizeof(HomekitBinding) * parsedCount);
+  table.count = parsedCount;
+  errorMessage = NULL;
+  return save();
+}
+
+bool HomekitBindings::configure(const char *text, unsigned int length, char *reply, size_t size) {
+  if (configure(text, length)) {
+    snprintf(reply, size, "ok %u", count());
+    return true;
+  }
+  snprintf(reply, size, "error %s", error());
+  return false;
+}
+
+const char *HomekitBindings::error() {
+  return errorMessage;
+}
+
+uint8_t HomekitBindings::count() {
+  return table.count;
+}
+
+bool HomekitBindings::sends(enum HomekitBindingEvent event) {
+  for (uint8_t i = 0; i < table.count; i++) {
+    if (table.bindings[i].type == HOMEKIT_BINDING_SEND && table.bindings[i].event == event) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HomekitBindings::save() {
+  if (!ring.append(&table, sizeof(table))) {
+    errorMessage = "failed to save";
+    return false;
+  }
+  return true;
+}
+
+// Sends a frame for every binding on event. Repeats of whatever was sent
+// before are dropped; it went out at least once.
+bool HomekitBindings::emit(enum HomekitBindingEvent event) {
+  if (!listening) {
+    return false;
+  }
+
+  pendingCount = 0;
+  for (uint8_t i = 0; i < table.count; i++) {
+    const HomekitBinding &binding = table.bindings[i];
+    if (binding.type != HOMEKIT_BINDING_SEND || binding.event != event) {
+      continue;
+    }
+
+    // One flash write per boot, and only on boots that send anything.
+    if (!epochBumped || counter == 0xffff) {
+      table.epoch++;
+      save();
+      epochBumped = true;
+      counter = 0;
+    }
+
+    HomekitBindingFrame &frame = pending[pendingCount++];
+    time_t now = time(NULL);
+    frame.magic = HOMEKIT_BINDINGS_MAGIC;
+    frame.version = HOMEKIT_BINDINGS_VERSION;
+    frame.action = binding.action;
+    frame.group = binding.group;
+    frame.reserved = 0;
+    frame.sender = ESP.getChipId();
+    frame.counter = (table.epoch << 16) | ++counter;
+    frame.time = now >= HOMEKIT_BINDINGS_VALID_TIME ? now : 0;
+    homekitAuthSign(key, &frame, offsetof(HomekitBindingFrame, tag), frame.tag);
+  }
+  if (pendingCount == 0) {
+    return false;
+  }
+
+  sendPending();
+  repeatsLeft = HOMEKIT_BINDINGS_REPEATS - 1;
+  repeatAt = millis() + HOMEKIT_BINDINGS_REPEAT_MS;
+  return true;
+}
+
+void HomekitBindings::sendPending() {
+  for (uint8_t i = 0; i < pendingCount; i++) {
+    udp.beginPacketMulticast(HOMEKIT_BINDINGS_GROUP, HOMEKIT_BINDINGS_PORT, WiFi.localIP());
+    udp.write((const uint8_t *)&pending[i], sizeof(HomekitBindingFrame));
+    udp.endPacket();
+  }
+}
+
+bool HomekitBindings::poll(enum HomekitBindingAction &action) {
+  if (!listening) {
+    return false;
+  }
+  if (repeatsLeft != 0 && (long)(millis() - repeatAt) >= 0) {
+    sendPending();
+    repeatsLeft--;
+    repeatAt = millis() + HOMEKIT_BINDINGS_REPEAT_MS;
+  }
+  return receive(action);
+}
+
+// Takes at most one frame per call. Our own frames come back to us too, and
+// are ignored along with anything unsigned, for another group, or seen before.
+bool HomekitBindings::receive(enum HomekitBindingAction &action) {
+  if (udp.parsePacket() == 0) {
+    return false;
+  }
+
+  HomekitBindingFrame frame;
+  if (udp.read((uint8_t *)&frame, sizeof(frame)) != (int)sizeof(frame) ||
+      frame.magic != HOMEKIT_BINDINGS_MAGIC || frame.version != HOMEKIT_BINDINGS_VERSION ||
+      frame.action > HOMEKIT_BINDING_TOGGLE || frame.sender == ESP.getChipId()) {
+    return false;
+  }
+
+  bool bound = false;
+  for (uint8_t i = 0; i < table.count && !bound; i++) {
+    bound = table.bindings[i].type == HOMEKIT_BINDING_RECEIVE && table.bindings[i].group == frame.group;
+  }
+  if (!bound || !homekitAuthVerify(key, &frame, offsetof(HomekitBindingFrame, tag), frame.tag) ||
+      !accept(frame)) {
+    return false;
+  }
+
+  action = (enum HomekitBindingAction)frame.action;
+  return true;
+}
+
+bool HomekitBindings::accept(const HomekitBindingFrame &frame) {
+  time_t now = time(NULL);
+  if (now >= HOMEKIT_BINDINGS_VALID_TIME && frame.time != 0 &&
+      (frame.time > now + HOMEKIT_BINDINGS_MAX_SKEW || frame.time + HOMEKIT_BINDINGS_MAX_SKEW < now)) {
+    Serial.println("Dropped binding frame with a stale time");
+    return false;
+  }
+
+  HomekitBindingSender *slot = &senders[0];
+  for (uint8_t i = 0; i < HOMEKIT_BINDINGS_SENDERS; i++) {
+    if (senders[i].sender == frame.sender) {
+      slot = &senders[i];
+      break;
+    }
+    if (senders[i].sender == 0 || (slot->sender != 0 && senders[i].heardAt - slot->heardAt > 0x80000000UL)) {
+      slot = &senders[i];
+    }
+  }
+  if (slot->sender == frame.sender && frame.counter <= slot->counter) {
+    return false;
+  }
+
+  slot->sender = frame.sender;
+  slot->counter = frame.counter;
+  slot->heardAt = millis();
+  return true;
+}
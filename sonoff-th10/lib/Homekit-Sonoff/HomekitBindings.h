@@ -0,0 +1,140 @@
+#ifndef HOMEKIT_BINDINGS_H_
+#define HOMEKIT_BINDINGS_H_
+
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include "HomekitFlash.h"
+#include "HomekitAuth.h"
+
+// Bindings go out to every device on the network at once, on the
+// administratively scoped multicast group 239.255.72.75 ("HK").
+#define HOMEKIT_BINDINGS_GROUP    IPAddress(239, 255, 72, 75)
+#define HOMEKIT_BINDINGS_PORT     4211
+#define HOMEKIT_BINDINGS_MAGIC    0x4248 // "HB"
+#define HOMEKIT_BINDINGS_VERSION  1
+
+#define HOMEKIT_MAX_BINDINGS      16
+// Remembered per sender to reject replays. The least recently heard from is
+// forgotten first.
+#define HOMEKIT_BINDINGS_SENDERS  8
+// Multicast isn't retried by the access point, so every frame is sent this
+// many times, this far apart. Receivers drop the copies.
+#define HOMEKIT_BINDINGS_REPEATS  3
+#define HOMEKIT_BINDINGS_REPEAT_MS 30
+// Frames further than this from our clock are refused, when both ends know
+// the time.
+#define HOMEKIT_BINDINGS_MAX_SKEW 60
+
+// What can set a binding off.
+enum HomekitBindingEvent {
+  HOMEKIT_BINDING_SINGLE,   // button gestures
+  HOMEKIT_BINDING_DOUBLE,
+  HOMEKIT_BINDING_LONG,
+  HOMEKIT_BINDING_RULE_ON,  // the rule engine switching on or off
+  HOMEKIT_BINDING_RULE_OFF,
+  HOMEKIT_BINDING_EVENTS,
+};
+
+enum HomekitBindingAction {
+  HOMEKIT_BINDING_ON,
+  HOMEKIT_BINDING_OFF,
+  HOMEKIT_BINDING_TOGGLE,
+};
+
+enum HomekitBindingType {
+  HOMEKIT_BINDING_SEND,
+  HOMEKIT_BINDING_RECEIVE,
+};
+
+struct HomekitBinding {
+  uint8_t type;
+  uint8_t event;
+  uint8_t action;
+  uint8_t reserved;
+  uint16_t group;
+};
+
+// As stored in flash. The epoch goes up on the first send of every boot, and
+// frame counters start from it, so they only ever increase.
+struct HomekitBindingTable {
+  uint32_t epoch;
+  uint8_t count;
+  uint8_t reserved[3];
+  HomekitBinding bindings[HOMEKIT_MAX_BINDINGS];
+};
+
+struct __attribute__((packed)) HomekitBindingFrame {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t action;
+  uint16_t group;
+  uint16_t reserved;
+  uint32_t sender;
+  uint32_t counter;
+  uint32_t time;
+  uint8_t tag[HOMEKIT_AUTH_TAG_SIZE];
+};
+
+struct HomekitBindingSender {
+  uint32_t sender;
+  uint32_t counter;
+  unsigned long heardAt;
+};
+
+// Device to device bindings that don't need the broker: an event on one
+// device is sent as a small signed multicast frame, and every device
+// receiving that group applies the action itself. Configured with text like
+//
+//   send single 1 toggle; send rule-on 2 on; receive 1
+//
+// where the events are single, double, long, rule-on and rule-off, groups
+// are numbers from 1 to 65535, and the actions are on, off and toggle.
+//
+// Frames are signed with the shared local key. Each carries a counter that
+// only goes up for a sender, so a captured frame can't be replayed while the
+// receiver remembers the sender; the time, when known, narrows the window
+// after the receiver reboots.
+class HomekitBindings {
+  public:
+    HomekitBindings();
+
+    bool begin();
+    void start(const char *key);
+    bool configure(const char *text, unsigned int length);
+    // As above, and writes the reply for the "bindings" topic to reply:
+    // "ok <count>" or "error <reason>".
+    bool configure(const char *text, unsigned int length, char *reply, size_t size);
+    const char *error();
+    uint8_t count();
+    // Whether any binding is sent on event.
+    bool sends(enum HomekitBindingEvent event);
+
+    bool emit(enum HomekitBindingEvent event);
+    // Returns true with the action when a frame for one of our groups has
+    // arrived. Also sends the repeats, so call it on every loop.
+    bool poll(enum HomekitBindingAction &action);
+
+  private:
+    HomekitFlashRing ring;
+    HomekitBindingTable table;
+    const char *key = NULL;
+    const char *errorMessage = NULL;
+    bool epochBumped = false;
+    uint16_t counter = 0;
+
+    WiFiUDP udp;
+    bool listening = false;
+    HomekitBindingSender senders[HOMEKIT_BINDINGS_SENDERS];
+
+    HomekitBindingFrame pending[HOMEKIT_MAX_BINDINGS];
+    uint8_t pendingCount = 0;
+    uint8_t repeatsLeft = 0;
+    unsigned long repeatAt = 0;
+
+    bool save();
+    void sendPending();
+    bool receive(enum HomekitBindingAction &action);
+    bool accept(const HomekitBindingFrame &frame);
+};
+
+#endif /* HOMEKIT_BINDINGS_H_ */
@@ -0,0 +1,149 @@
+#include "HomekitButton.h"
+
+static HomekitButton *g_HomekitButtonInstance;
+
+HomekitButton::HomekitButton(uint8_t pin, bool activeLow) {
+  this->pin = pin;
+  this->activeLow = activeLow;
+  g_HomekitButtonInstance = this;
+}
+
+void HomekitButton::begin() {
+  pinMode(pin, INPUT);
+  stable = readPressed();
+  lastEdgeAt = millis();
+  attachInterrupt(digitalPinToInterrupt(pin), HomekitButton::_onEdge, CHANGE);
+}
+
+void HomekitButton::setDoublePressWindow(unsigned long ms) {
+  doublePressWindow = ms;
+}
+
+bool HomekitButton::isPressed() {
+  return stable;
+}
+
+// Returns true with the next completed gesture, if there is one. Edges are
+// decoded in the order and at the times they happened, so call this as often
+// as convenient.
+bool HomekitButton::poll(enum HomekitButtonGesture &gesture) {
+  while (true) {
+    bool pending = tail != head;
+    // A timeout only counts if it expired before the next edge.
+    uint32_t until = pending ? edges[tail].time : millis();
+    if (checkTimeouts(until, gesture)) {
+      return true;
+    }
+    if (!pending) {
+      break;
+    }
+
+    HomekitButtonEdge edge = edges[tail];
+    tail = (tail + 1) & (HOMEKIT_BUTTON_QUEUE - 1);
+    if (applyEdge(edge, gesture)) {
+      return true;
+    }
+  }
+
+  // An edge can be lost to a full queue, or be the tail end of some bounce. If
+  // the pin has settled somewhere other than where we think it is, catch up.
+  uint32_t now = millis();
+  bool pressed = readPressed();
+  if (pressed != stable && now - lastEdgeAt >= HOMEKIT_BUTTON_DEBOUNCE_MS) {
+    HomekitButtonEdge edge = {now, pressed};
+    return applyEdge(edge, gesture);
+  }
+  return false;
+}
+
+bool HomekitButton::readPressed() {
+  return digitalRead(pin) == (activeLow ? LOW : HIGH);
+}
+
+bool HomekitButton::checkTimeouts(uint32_t now, enum HomekitButtonGesture &gesture) {
+  switch (state) {
+    case PRESSED:
+    case SECOND_PRESSED:
+      if (now - pressedAt >= HOMEKIT_BUTTON_HOLD_MS) {
+        state = HELD;
+        gesture = HOMEKIT_BUTTON_HOLD;
+        return true;
+      }
+      return false;
+
+    case WAITING_FOR_SECOND:
+      if (now - releasedAt >= doublePressWindow) {
+        state = IDLE;
+        gesture = HOMEKIT_BUTTON_SINGLE;
+        return true;
+      }
+      return false;
+
+    default:
+      return false;
+  }
+}
+
+bool HomekitButton::applyEdge(const HomekitButtonEdge &edge, enum HomekitButtonGesture &gesture) {
+  if (edge.pressed == stable || edge.time - lastEdgeAt < HOMEKIT_BUTTON_DEBOUNCE_MS) {
+    return false;
+  }
+  stable = edge.pressed;
+  lastEdgeAt = edge.time;
+
+  switch (state) {
+    case IDLE:
+      if (edge.pressed) {
+        state = PRESSED;
+        pressedAt = edge.time;
+      }
+      return false;
+
+    case PRESSED:
+      if (edge.time - pressedAt >= HOMEKIT_BUTTON_LONG_MS) {
+        state = IDLE;
+        gesture = HOMEKIT_BUTTON_LONG;
+        return true;
+      }
+      if (doublePressWindow == 0) {
+        state = IDLE;
+        gesture = HOMEKIT_BUTTON_SINGLE;
+        return true;
+      }
+      state = WAITING_FOR_SECOND;
+      releasedAt = edge.time;
+      return false;
+
+    case WAITING_FOR_SECOND:
+      state = SECOND_PRESSED;
+      pressedAt = edge.time;
+      return false;
+
+    case SECOND_PRESSED:
+      state = IDLE;
+      gesture = HOMEKIT_BUTTON_DOUBLE;
+      return true;
+
+    case HELD:
+      state = IDLE;
+      return false;
+  }
+  return false;
+}
+
+void ICACHE_RAM_ATTR HomekitButton::onEdge() {
+  uint8_t next = (head + 1) & (HOMEKIT_BUTTON_QUEUE - 1);
+  if (next == tail) {
+    // Full. poll() will pick the level up again once it catches up.
+    return;
+  }
+  edges[head].time = millis();
+  // Read the pin register directly: readPressed() lives in flash, which may
+  // be mid erase or write while this runs.
+  edges[head].pressed = (GPIP(pin) != 0) != activeLow;
+  head = next;
+}
+
+void ICACHE_RAM_ATTR HomekitButton::_onEdge() {
+  g_HomekitButtonInstance->onEdge();
+}
@@ -0,0 +1,78 @@
+#ifndef HOMEKIT_BUTTON_H_
+#define HOMEKIT_BUTTON_H_
+
+#include <Arduino.h>
+
+// Edges closer together than this are contact bounce.
+#define HOMEKIT_BUTTON_DEBOUNCE_MS  20
+// A press held at least this long is a long press.
+#define HOMEKIT_BUTTON_LONG_MS      1000
+// Held this long, the button resets the device.
+#define HOMEKIT_BUTTON_HOLD_MS      10000
+// A second press starting within this long of the first ending makes a
+// double press.
+#define HOMEKIT_BUTTON_DOUBLE_MS    300
+// Must be a power of two.
+#define HOMEKIT_BUTTON_QUEUE        16
+
+enum HomekitButtonGesture {
+  HOMEKIT_BUTTON_SINGLE,
+  HOMEKIT_BUTTON_DOUBLE,
+  HOMEKIT_BUTTON_LONG,
+  HOMEKIT_BUTTON_HOLD,
+};
+
+struct HomekitButtonEdge {
+  uint32_t time;
+  bool pressed;
+};
+
+// The button is captured by a pin change interrupt that timestamps every edge
+// into a queue, and gestures are decoded from those timestamps in poll(). A
+// loop() that's held up (a blocking reconnect, say) only delays when a
+// gesture is reported, not what it's decoded as.
+//
+// Only one instance is supported, as with DHTAsync. The pin has to be one of
+// GPIO 0-15, which the interrupt handler can read straight from the register.
+class HomekitButton {
+  public:
+    HomekitButton(uint8_t pin, bool activeLow = true);
+    void begin();
+    // Set to 0 to report single presses as soon as they're released, when
+    // nothing is listening for double presses.
+    void setDoublePressWindow(unsigned long ms);
+    bool poll(enum HomekitButtonGesture &gesture);
+    bool isPressed();
+
+  private:
+    enum State {
+      IDLE,
+      PRESSED,
+      WAITING_FOR_SECOND,
+      SECOND_PRESSED,
+      HELD,
+    };
+
+    uint8_t pin;
+    bool activeLow;
+    unsigned long doublePressWindow = HOMEKIT_BUTTON_DOUBLE_MS;
+
+    // Written by the interrupt handler only (head) and loop() only (tail).
+    HomekitButtonEdge edges[HOMEKIT_BUTTON_QUEUE];
+    volatile uint8_t head = 0;
+    volatile uint8_t tail = 0;
+
+    enum State state = IDLE;
+    bool stable = false;
+    uint32_t lastEdgeAt = 0;
+    uint32_t pressedAt = 0;
+    uint32_t releasedAt = 0;
+
+    bool readPressed();
+    bool checkTimeouts(uint32_t now, enum HomekitButtonGesture &gesture);
+    bool applyEdge(const HomekitButtonEdge &edge, enum HomekitButtonGesture &gesture);
+    void onEdge();
+    static void _onEdge();
+};
+
+#endif /* HOMEKIT_BUTTON_H_ */
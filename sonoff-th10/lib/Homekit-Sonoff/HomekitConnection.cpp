@@ -0,0 +1,64 @@
+#include "HomekitConnection.h"
+#include <ESP8266WiFi.h>
+
+HomekitConnection::HomekitConnection(PubSubClient &client) : client(client) {
+}
+
+void HomekitConnection::begin(HOMEKIT_CONNECT_SIGNATURE connect, HOMEKIT_CONNECTED_SIGNATURE onConnected) {
+  connectCallback = connect;
+  onConnectedCallback = onConnected;
+  client.setSocketTimeout(HOMEKIT_CONNECT_TIMEOUT_MS / 1000);
+}
+
+bool HomekitConnection::tick() {
+  switch (state) {
+    case HOMEKIT_MQTT_CONNECTED:
+      if (client.loop()) {
+        return true;
+      }
+      Serial.print("MQTT connection lost, rc=");
+      Serial.println(client.state());
+      scheduleReconnect();
+      return false;
+
+    case HOMEKIT_MQTT_BACKOFF:
+      if (!backoff.due()) {
+        return false;
+      }
+      // Backoff has elapsed, fall through and try again.
+
+    case HOMEKIT_MQTT_DISCONNECTED:
+      if (WiFi.status() != WL_CONNECTED) {
+        return false;
+      }
+      return reconnect();
+  }
+  return false;
+}
+
+bool HomekitConnection::connected() {
+  return state == HOMEKIT_MQTT_CONNECTED;
+}
+
+bool HomekitConnection::reconnect() {
+  Serial.println("Attempting MQTT connection...");
+  if (!connectCallback()) {
+    Serial.print("failed, rc=");
+    Serial.println(client.state());
+    scheduleReconnect();
+    return false;
+  }
+
+  state = HOMEKIT_MQTT_CONNECTED;
+  backoff.reset();
+  if (onConnectedCallback != NULL) {
+    onConnectedCallback();
+  }
+  return true;
+}
+
+void HomekitConnection::scheduleReconnect() {
+  unsigned long wait = backoff.schedule();
+  state = HOMEKIT_MQTT_BACKOFF;
+  Serial.printf("Next MQTT connection attempt in %lums\n", wait);
+}
@@ -0,0 +1,51 @@
+#ifndef HOMEKIT_CONNECTION_H_
+#define HOMEKIT_CONNECTION_H_
+
+#include <Arduino.h>
+#include <functional>
+#include <PubSubClient.h>
+#include "HomekitBackoff.h"
+
+// Tries to connect, returning whether it did.
+#define HOMEKIT_CONNECT_SIGNATURE std::function<bool(void)>
+// Runs once connected, to subscribe and catch the broker up.
+#define HOMEKIT_CONNECTED_SIGNATURE std::function<void(void)>
+
+// How long a connect attempt may block, for the firmware's transport client,
+// on each of the TCP connect, the TLS handshake and the CONNACK. Everything
+// else in the loop stalls meanwhile.
+#define HOMEKIT_CONNECT_TIMEOUT_MS 3000
+
+enum HomekitConnectionState {
+  HOMEKIT_MQTT_DISCONNECTED,
+  HOMEKIT_MQTT_BACKOFF,
+  HOMEKIT_MQTT_CONNECTED,
+};
+
+// Keeps the MQTT client connected without ever blocking on a broker that's
+// gone: losing the connection or failing to connect waits out a
+// HomekitBackoff, and nothing is tried while Wi-Fi is down. What connecting
+// involves (client id, will, TLS) and what happens once connected are left
+// to the firmware.
+class HomekitConnection {
+  public:
+    HomekitConnection(PubSubClient &client);
+
+    void begin(HOMEKIT_CONNECT_SIGNATURE connect, HOMEKIT_CONNECTED_SIGNATURE onConnected);
+    // Call on every pass. Returns true while connected, with the client
+    // polled.
+    bool tick();
+    bool connected();
+
+  private:
+    PubSubClient &client;
+    HomekitBackoff backoff;
+    enum HomekitConnectionState state = HOMEKIT_MQTT_DISCONNECTED;
+    HOMEKIT_CONNECT_SIGNATURE connectCallback;
+    HOMEKIT_CONNECTED_SIGNATURE onConnectedCallback;
+
+    bool reconnect();
+    void scheduleReconnect();
+};
+
+#endif /* HOMEKIT_CONNECTION_H_ */
@@ -0,0 +1,77 @@
+#include "HomekitFixed.h"
+
+size_t homekitFormatFixed(char *buffer, size_t size, int32_t value, uint8_t decimals) {
+  char digits[11];
+  uint8_t count = 0;
+  uint32_t magnitude = value < 0 ? -(uint32_t)value : value;
+
+  // Always emit at least one digit before the decimal point.
+  do {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while ((magnitude != 0 || count <= decimals) && count < sizeof(digits));
+
+  size_t length = count + (decimals != 0 ? 1 : 0) + (value < 0 ? 1 : 0);
+  if (length >= size) {
+    return 0;
+  }
+
+  char *p = buffer;
+  if (value < 0) {
+    *p++ = '-';
+  }
+  while (count > 0) {
+    *p++ = digits[--count];
+    if (count == decimals && decimals != 0) {
+      *p++ = '.';
+    }
+  }
+  *p = '\0';
+  return length;
+}
+
+bool homekitParseFixed(const char *str, unsigned int length, uint8_t decimals, int32_t &value) {
+  unsigned int i = 0;
+  bool negative = false;
+  if (i < length && (str[i] == '-' || str[i] == '+')) {
+    negative = str[i] == '-';
+    i++;
+  }
+
+  int32_t result = 0;
+  bool sawDigit = false;
+  int8_t fraction = -1;
+  for (; i < length; i++) {
+    char c = str[i];
+    if (c == '.' && fraction < 0) {
+      fraction = 0;
+    } else if (c >= '0' && c <= '9') {
+      sawDigit = true;
+      int32_t digit = c - '0';
+      if (fraction >= decimals) {
+        continue;
+      }
+      if (result > (INT32_MAX - digit) / 10) {
+        return false;
+      }
+      result = result * 10 + digit;
+      if (fraction >= 0) {
+        fraction++;
+      }
+    } else {
+      return false;
+    }
+  }
+  if (!sawDigit) {
+    return false;
+  }
+
+  for (int8_t j = fraction < 0 ? 0 : fraction; j < decimals; j++) {
+    if (result > INT32_MAX / 10) {
+      return false;
+    }
+    result *= 10;
+  }
+  value = negative ? -result : result;
+  return true;
+}
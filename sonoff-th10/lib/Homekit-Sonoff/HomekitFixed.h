@@ -0,0 +1,18 @@
+#ifndef HOMEKIT_FIXED_H_
+#define HOMEKIT_FIXED_H_
+
+#include <Arduino.h>
+
+// Conversions between decimal strings and integers scaled by 10^decimals, for
+// payloads on a core without an FPU. Kept free of the rest of Homekit so
+// tools/test_fixed.py can build them on the host.
+
+// Writes value / 10^decimals as a decimal string. Returns the length written,
+// or 0 if it didn't fit.
+size_t homekitFormatFixed(char *buffer, size_t size, int32_t value, uint8_t decimals);
+// Parses a decimal string such as "-1.5" into value * 10^decimals. Digits past
+// the requested precision are truncated, and anything that doesn't fit an
+// int32_t is rejected. The input need not be NUL terminated.
+bool homekitParseFixed(const char *str, unsigned int length, uint8_t decimals, int32_t &value);
+
+#endif /* HOMEKIT_FIXED_H_ */
@@ -0,0 +1,292 @@
+#include "HomekitFlash.h"
+#include "HomekitRtc.h"
+#include <flash_hal.h>
+
+#define HOMEKIT_FLASH_SECTOR_MAGIC  0x31524b48 // "HKR1"
+#define HOMEKIT_FLASH_SECTOR_HEADER 8
+#define HOMEKIT_FLASH_RECORD_MAGIC  0x5a5a
+#define HOMEKIT_FLASH_RECORD_LIVE   0xffffffff
+
+#define HOMEKIT_FLASH_ALIGN(n) (((n) + 3) & ~3)
+
+// Cursors pack the sector sequence number above a 12 bit sector offset.
+#define HOMEKIT_FLASH_CURSOR(sequence, offset) (((sequence) << 12) | (offset))
+
+// flashWrite needs a word aligned source, so records are assembled here.
+static uint32_t g_HomekitFlashBuffer[(sizeof(HomekitFlashRecordHeader) + HOMEKIT_FLASH_MAX_RECORD + 3) / 4];
+
+HomekitFlashRing::HomekitFlashRing(uint16_t firstSector, uint8_t sectorCount) {
+  this->firstSector = firstSector;
+  this->sectorCount = sectorCount;
+}
+
+bool HomekitFlashRing::begin() {
+  if ((firstSector + sectorCount) * SPI_FLASH_SEC_SIZE > FS_PHYS_SIZE) {
+    Serial.println("Not enough flash reserved for storage, is the FS region too small?");
+    return false;
+  }
+  base = FS_PHYS_ADDR + firstSector * SPI_FLASH_SEC_SIZE;
+
+  // The newest sector is the one with the highest sequence number.
+  headSequence = 0;
+  for (uint8_t sector = 0; sector < sectorCount; sector++) {
+    uint32_t sequence = sectorSequence(sector);
+    if (sequence > headSequence) {
+      headSequence = sequence;
+      headSector = sector;
+    }
+  }
+
+  if (headSequence == 0) {
+    ready = startSector(0, 1);
+    return ready;
+  }
+
+  // Find the end of the newest sector. Anything that doesn't look like a
+  // record header ends it, torn writes included; those bytes can't be
+  // written over again until the sector is erased.
+  ready = true;
+  writeOffset = HOMEKIT_FLASH_SECTOR_HEADER;
+  HomekitFlashRecordHeader header;
+  while (readHeader(sectorAddress(headSector), writeOffset, header)) {
+    writeOffset += sizeof(header) + HOMEKIT_FLASH_ALIGN(header.length);
+  }
+  if (writeOffset + sizeof(header) <= SPI_FLASH_SEC_SIZE) {
+    uint32_t word;
+    ESP.flashRead(sectorAddress(headSector) + writeOffset, &word, sizeof(word));
+    if (word != 0xffffffff) {
+      writeOffset = SPI_FLASH_SEC_SIZE;
+    }
+  }
+  return true;
+}
+
+void HomekitFlashRing::setMinEraseInterval(unsigned long ms) {
+  minEraseInterval = ms;
+}
+
+bool HomekitFlashRing::append(const void *data, uint16_t length) {
+  if (!ready || length > HOMEKIT_FLASH_MAX_RECORD) {
+    return false;
+  }
+
+  uint32_t total = sizeof(HomekitFlashRecordHeader) + HOMEKIT_FLASH_ALIGN(length);
+  if (writeOffset + total > SPI_FLASH_SEC_SIZE) {
+    // Counted from boot for the first erase, so a device stuck in a reboot
+    // loop can't erase a sector on every boot.
+    if (millis() - lastEraseAt < minEraseInterval) {
+      droppedCount++;
+      return false;
+    }
+    if (!startSector((headSector + 1) % sectorCount, headSequence + 1)) {
+      return false;
+    }
+  }
+
+  HomekitFlashRecordHeader *header = (HomekitFlashRecordHeader *)g_HomekitFlashBuffer;
+  header->magic = HOMEKIT_FLASH_RECORD_MAGIC;
+  header->length = length;
+  header->crc = homekitCrc32(data, length);
+  header->state = HOMEKIT_FLASH_RECORD_LIVE;
+  memset((uint8_t *)g_HomekitFlashBuffer + sizeof(*header), 0xff, HOMEKIT_FLASH_ALIGN(length));
+  memcpy((uint8_t *)g_HomekitFlashBuffer + sizeof(*header), data, length);
+
+  if (!ESP.flashWrite(sectorAddress(headSector) + writeOffset, g_HomekitFlashBuffer, total)) {
+    Serial.println("Flash write failed");
+    writeOffset = SPI_FLASH_SEC_SIZE;
+    return false;
+  }
+  writeOffset += total;
+  return true;
+}
+
+bool HomekitFlashRing::read(uint32_t &cursor, void *data, uint16_t size, uint16_t &length) {
+  if (!ready) {
+    return false;
+  }
+
+  uint32_t sequence = cursor == 0 ? oldestSequence() : cursor >> 12;
+  uint32_t offset = cursor == 0 ? HOMEKIT_FLASH_SECTOR_HEADER : cursor & 0xfff;
+  HomekitFlashRecordHeader header;
+  uint32_t address;
+  bool found = false;
+
+  while (!found && walk(sequence, offset, header, address)) {
+    offset += sizeof(header) + HOMEKIT_FLASH_ALIGN(header.length);
+    if (header.state == HOMEKIT_FLASH_RECORD_LIVE && header.length <= size &&
+        readRecord(address, header, data)) {
+      length = header.length;
+      found = true;
+    }
+  }
+
+  cursor = HOMEKIT_FLASH_CURSOR(sequence, offset);
+  return found;
+}
+
+void HomekitFlashRing::consumeUntil(uint32_t cursor) {
+  if (!ready) {
+    return;
+  }
+
+  uint32_t sequence = oldestSequence();
+  uint32_t offset = HOMEKIT_FLASH_SECTOR_HEADER;
+  HomekitFlashRecordHeader header;
+  uint32_t address;
+
+  while (HOMEKIT_FLASH_CURSOR(sequence, offset) < cursor && walk(sequence, offset, header, address)) {
+    if (HOMEKIT_FLASH_CURSOR(sequence, offset) >= cursor) {
+      return;
+    }
+    if (header.state == HOMEKIT_FLASH_RECORD_LIVE) {
+      consume(address);
+    }
+    offset += sizeof(header) + HOMEKIT_FLASH_ALIGN(header.length);
+  }
+}
+
+bool HomekitFlashRing::readLatest(void *data, uint16_t size, uint16_t &length) {
+  if (!ready) {
+    return false;
+  }
+
+  // Walk forward remembering the last intact record. Only meant for the
+  // small rings that hold settings, where this is a few dozen reads.
+  uint32_t sequence = oldestSequence();
+  uint32_t offset = HOMEKIT_FLASH_SECTOR_HEADER;
+  HomekitFlashRecordHeader header;
+  uint32_t address;
+  bool found = false;
+
+  while (walk(sequence, offset, header, address)) {
+    offset += sizeof(header) + HOMEKIT_FLASH_ALIGN(header.length);
+    if (header.length <= size && readRecord(address, header, data)) {
+      length = header.length;
+      found = true;
+    }
+  }
+  return found;
+}
+
+uint32_t HomekitFlashRing::erases() {
+  return eraseCount;
+}
+
+uint32_t HomekitFlashRing::dropped() {
+  return droppedCount;
+}
+
+uint32_t HomekitFlashRing::sectorAddress(uint8_t sector) {
+  return base + sector * SPI_FLASH_SEC_SIZE;
+}
+
+uint32_t HomekitFlashRing::sectorSequence(uint8_t sector) {
+  uint32_t header[2];
+  ESP.flashRead(sectorAddress(sector), header, sizeof(header));
+  if (header[0] != HOMEKIT_FLASH_SECTOR_MAGIC || header[1] == 0xffffffff) {
+    return 0;
+  }
+  return header[1];
+}
+
+// Sectors are written in order, so the sector holding a given sequence number
+// is found by counting back from the head.
+bool HomekitFlashRing::sectorFor(uint32_t sequence, uint8_t &sector) {
+  if (sequence == 0 || sequence > headSequence || headSequence - sequence >= sectorCount) {
+    return false;
+  }
+  sector = (headSector + sectorCount - (headSequence - sequence)) % sectorCount;
+  return sequence == headSequence || sectorSequence(sector) == sequence;
+}
+
+uint32_t HomekitFlashRing::oldestSequence() {
+  uint32_t oldest = headSequence;
+  uint8_t sector;
+  while (oldest > 1 && sectorFor(oldest - 1, sector)) {
+    oldest--;
+  }
+  return oldest;
+}
+
+bool HomekitFlashRing::startSector(uint8_t sector, uint32_t sequence) {
+  // Count whatever unsent records are about to be lost.
+  uint32_t oldSequence = sectorSequence(sector);
+  if (oldSequence != 0 && ready) {
+    uint32_t offset = HOMEKIT_FLASH_SECTOR_HEADER;
+    HomekitFlashRecordHeader header;
+    while (readHeader(sectorAddress(sector), offset, header)) {
+      if (header.state == HOMEKIT_FLASH_RECORD_LIVE) {
+        droppedCount++;
+      }
+      offset += sizeof(header) + HOMEKIT_FLASH_ALIGN(header.length);
+    }
+  }
+
+  uint32_t header[2] = {HOMEKIT_FLASH_SECTOR_MAGIC, sequence};
+  if (!ESP.flashEraseSector(sectorAddress(sector) / SPI_FLASH_SEC_SIZE) ||
+      !ESP.flashWrite(sectorAddress(sector), header, sizeof(header))) {
+    Serial.println("Flash erase failed");
+    return false;
+  }
+  eraseCount++;
+  lastEraseAt = millis();
+
+  headSector = sector;
+  headSequence = sequence;
+  writeOffset = HOMEKIT_FLASH_SECTOR_HEADER;
+  return true;
+}
+
+// Finds the first record header at or after (sequence, offset), following the
+// sectors in the order they were written. If that position has since been
+// erased, carries on from the oldest sector that's left.
+bool HomekitFlashRing::walk(uint32_t &sequence, uint32_t &offset, HomekitFlashRecordHeader &header, uint32_t &address) {
+  while (true) {
+    uint8_t sector;
+    if (!sectorFor(sequence, sector)) {
+      if (sequence > headSequence) {
+        return false;
+      }
+      sequence = oldestSequence();
+      offset = HOMEKIT_FLASH_SECTOR_HEADER;
+      continue;
+    }
+
+    uint32_t limit = sequence == headSequence ? writeOffset : SPI_FLASH_SEC_SIZE;
+    if (offset + sizeof(header) <= limit && readHeader(sectorAddress(sector), offset, header)) {
+      address = sectorAddress(sector) + offset;
+      return true;
+    }
+    if (sequence == headSequence) {
+      return false;
+    }
+    sequence++;
+    offset = HOMEKIT_FLASH_SECTOR_HEADER;
+  }
+}
+
+bool HomekitFlashRing::readHeader(uint32_t address, uint32_t offset, HomekitFlashRecordHeader &header) {
+  if (offset + sizeof(header) > SPI_FLASH_SEC_SIZE) {
+    return false;
+  }
+  ESP.flashRead(address + offset, (uint32_t *)&header, sizeof(header));
+  return header.magic == HOMEKIT_FLASH_RECORD_MAGIC && header.length <= HOMEKIT_FLASH_MAX_RECORD &&
+         offset + sizeof(header) + HOMEKIT_FLASH_ALIGN(header.length) <= SPI_FLASH_SEC_SIZE;
+}
+
+bool HomekitFlashRing::readRecord(uint32_t address, const HomekitFlashRecordHeader &header, void *data) {
+  uint32_t aligned = HOMEKIT_FLASH_ALIGN(header.length);
+  if (aligned != 0) {
+    ESP.flashRead(address + sizeof(header), g_HomekitFlashBuffer, aligned);
+  }
+  if (homekitCrc32(g_HomekitFlashBuffer, header.length) != header.crc) {
+    return false;
+  }
+  memcpy(data, g_HomekitFlashBuffer, header.length);
+  return true;
+}
+
+void HomekitFlashRing::consume(uint32_t address) {
+  uint32_t consumed = 0;
+  ESP.flashWrite(address + offsetof(HomekitFlashRecordHeader, state), &consumed, sizeof(consumed));
+}
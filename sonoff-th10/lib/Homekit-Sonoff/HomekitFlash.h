@@ -0,0 +1,92 @@
+#ifndef HOMEKIT_FLASH_H_
+#define HOMEKIT_FLASH_H_
+
+#include <Arduino.h>
+
+// Homekit keeps its persistent data in raw sectors of the filesystem region
+// (FS_PHYS_ADDR/FS_PHYS_SIZE from the linker script), so SPIFFS/LittleFS must
+// not be mounted alongside it. Sector numbers below are relative to the start
+// of that region, which is 64K (16 sectors) on the 512K and 1M boards.
+#define HOMEKIT_FLASH_QUEUE             0
+#define HOMEKIT_FLASH_QUEUE_SECTORS     8
+#define HOMEKIT_FLASH_WIFI              8
+#define HOMEKIT_FLASH_WIFI_SECTORS      2
+#define HOMEKIT_FLASH_SETTINGS          10
+#define HOMEKIT_FLASH_SETTINGS_SECTORS  2
+// Free for the firmware, e.g. the relay's last state.
+#define HOMEKIT_FLASH_STATE             12
+#define HOMEKIT_FLASH_STATE_SECTORS     2
+#define HOMEKIT_FLASH_BINDINGS          14
+#define HOMEKIT_FLASH_BINDINGS_SECTORS  2
+
+// Largest record, header excluded, that can be appended.
+#define HOMEKIT_FLASH_MAX_RECORD        192
+
+struct HomekitFlashRecordHeader {
+  uint16_t magic;
+  uint16_t length;
+  uint32_t crc;
+  // Left erased (all ones) when written, and cleared to zero once the record
+  // has been consumed. Flash can always clear bits without an erase.
+  uint32_t state;
+};
+
+// An append-only log of CRC checked records spread across a range of flash
+// sectors. Writes fill one sector at a time; when the log wraps, the oldest
+// sector is erased and whatever it still held is lost. Every sector is erased
+// equally often, and setMinEraseInterval() puts a hard ceiling on how often
+// that can be.
+//
+// Each sector starts with a sequence number, so after a reboot the newest
+// sector (and from it the write position) is found by scanning a handful of
+// headers. A record torn by a power cut fails its CRC and is skipped.
+//
+// Cursors encode a sector sequence number and an offset into that sector, and
+// stay meaningful across appends. A cursor of 0 means "the oldest record".
+class HomekitFlashRing {
+  public:
+    HomekitFlashRing(uint16_t firstSector, uint8_t sectorCount);
+
+    bool begin();
+    bool append(const void *data, uint16_t length);
+    void setMinEraseInterval(unsigned long ms);
+
+    // Reads the first unconsumed record at or after cursor and moves cursor
+    // past it. Returns false once there are no more.
+    bool read(uint32_t &cursor, void *data, uint16_t size, uint16_t &length);
+    // Marks every record before cursor as consumed.
+    void consumeUntil(uint32_t cursor);
+    // Reads the most recently appended intact record, consumed or not.
+    bool readLatest(void *data, uint16_t size, uint16_t &length);
+
+    uint32_t erases();
+    uint32_t dropped();
+
+  private:
+    uint16_t firstSector;
+    uint8_t sectorCount;
+    uint32_t base;
+    bool ready = false;
+
+    uint8_t headSector;
+    uint32_t headSequence;
+    uint32_t writeOffset;
+
+    unsigned long minEraseInterval = 0;
+    unsigned long lastEraseAt = 0; // Boot, until the first erase.
+    uint32_t eraseCount = 0;
+    uint32_t droppedCount = 0;
+
+    uint32_t sectorAddress(uint8_t sector);
+    uint32_t sectorSequence(uint8_t sector);
+    bool sectorFor(uint32_t sequence, uint8_t &sector);
+    uint32_t oldestSequence();
+    bool startSector(uint8_t sector, uint32_t sequence);
+
+    bool walk(uint32_t &sequence, uint32_t &offset, HomekitFlashRecordHeader &header, uint32_t &address);
+    bool readHeader(uint32_t address, uint32_t offset, HomekitFlashRecordHeader &header);
+    bool readRecord(uint32_t address, const HomekitFlashRecordHeader &header, void *data);
+    void consume(uint32_t address);
+};
+
+#endif /* HOMEKIT_FLASH_H_ */
@@ -0,0 +1,112 @@
+#include "HomekitGroups.h"
+
+static bool homekitGroupSeparator(char c) {
+  return c == ' ' || c == ',';
+}
+
+bool homekitGroupsParse(const char *list, unsigned int length, char *groups, size_t size) {
+  char parsed[HOMEKIT_MAX_GROUPS * (HOMEKIT_MAX_GROUP_NAME + 1)];
+  size_t used = 0;
+  uint8_t count = 0;
+
+  unsigned int i = 0;
+  while (i < length) {
+    if (homekitGroupSeparator(list[i])) {
+      i++;
+      continue;
+    }
+    unsigned int start = i;
+    while (i < length && !homekitGroupSeparator(list[i])) {
+      char c = list[i++];
+      if (c == '/' || c == '+' || c == '#' || c < ' ') {
+        return false;
+      }
+    }
+    if (count == HOMEKIT_MAX_GROUPS || i - start > HOMEKIT_MAX_GROUP_NAME) {
+      return false;
+    }
+    if (count != 0) {
+      parsed[used++] = ' ';
+    }
+    memcpy(parsed + used, list + start, i - start);
+    used += i - start;
+    count++;
+  }
+
+  if (used >= size) {
+    return false;
+  }
+  memcpy(groups, parsed, used);
+  groups[used] = '\0';
+  return true;
+}
+
+uint8_t homekitGroupsSplit(const char *groups, char names[HOMEKIT_MAX_GROUPS][HOMEKIT_MAX_GROUP_NAME + 1]) {
+  uint8_t count = 0;
+  const char *start = groups;
+  while (*start != '\0' && count < HOMEKIT_MAX_GROUPS) {
+    const char *end = strchr(start, ' ');
+    size_t length = end != NULL ? end - start : strlen(start);
+    if (length > HOMEKIT_MAX_GROUP_NAME) {
+      length = HOMEKIT_MAX_GROUP_NAME;
+    }
+    memcpy(names[count], start, length);
+    names[count][length] = '\0';
+    count++;
+    if (end == NULL) {
+      break;
+    }
+    start = end + 1;
+  }
+  return count;
+}
+
+bool homekitGroupsContain(const char *groups, const char *name, size_t length) {
+  const char *start = groups;
+  while (*start != '\0') {
+    const char *end = strchr(start, ' ');
+    size_t nameLength = end != NULL ? end - start : strlen(start);
+    if (nameLength == length && strncmp(start, name, length) == 0) {
+      return true;
+    }
+    if (end == NULL) {
+      return false;
+    }
+    start = end + 1;
+  }
+  return false;
+}
+
+bool homekitGroupsConfigure(const char *list, unsigned int length, HomekitSettingsStore &store,
+                            HomekitSettings &settings, HOMEKIT_GROUPS_SUBSCRIBE_SIGNATURE resubscribe) {
+  char groups[sizeof(settings.groups)];
+  if (!homekitGroupsParse(list, length, groups, sizeof(groups))) {
+    return false;
+  }
+  if (strcmp(groups, settings.groups) != 0) {
+    resubscribe(false);
+    strcpy(settings.groups, groups);
+    store.save(settings);
+    resubscribe(true);
+  }
+  return true;
+}
+
+void homekitGroupsSubscribe(PubSubClient &client, const char *prefix, const char *groups, const char *suffix,
+                            bool subscribe) {
+  if (!client.connected()) {
+    return;
+  }
+  char names[HOMEKIT_MAX_GROUPS][HOMEKIT_MAX_GROUP_NAME + 1];
+  uint8_t count = homekitGroupsSplit(groups, names);
+  char topic[64];
+  for (uint8_t i = 0; i < count; i++) {
+    snprintf(topic, sizeof(topic), "%s%s/%s", prefix, names[i], suffix);
+    if (subscribe) {
+      Serial.printf("Subscribed to topic: %s\n", topic);
+      client.subscribe(topic);
+    } else {
+      client.unsubscribe(topic);
+    }
+  }
+}
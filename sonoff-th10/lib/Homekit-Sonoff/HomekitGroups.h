@@ -0,0 +1,47 @@
+#ifndef HOMEKIT_GROUPS_H_
+#define HOMEKIT_GROUPS_H_
+
+#include <Arduino.h>
+#include <functional>
+#include <PubSubClient.h>
+#include "HomekitSettings.h"
+
+#define HOMEKIT_MAX_GROUPS      4
+#define HOMEKIT_MAX_GROUP_NAME  15
+
+// Replies to a group command are held back a random delay of up to this, so
+// a whole group answering doesn't land on the broker in the same moment.
+#ifndef HOMEKIT_GROUP_JITTER_MS
+#define HOMEKIT_GROUP_JITTER_MS 2000
+#endif
+
+// Moves the subscriptions over when the groups change: called with false
+// before, and true after.
+#define HOMEKIT_GROUPS_SUBSCRIBE_SIGNATURE std::function<void(bool subscribe)>
+
+// A device can belong to a few named groups, and takes the commands it takes
+// on its own topics on each group's topics as well, e.g. "esp/group/<name>/
+// republish" next to "esp/<mac>/republish". Memberships are kept in
+// HomekitSettings::groups as names separated by single spaces.
+
+// Turns a list of names separated by spaces or commas into that form.
+// Returns false, leaving groups alone, if there are too many or a name is too
+// long or isn't usable in a topic.
+bool homekitGroupsParse(const char *list, unsigned int length, char *groups, size_t size);
+// Splits groups into names, returning how many there are.
+uint8_t homekitGroupsSplit(const char *groups, char names[HOMEKIT_MAX_GROUPS][HOMEKIT_MAX_GROUP_NAME + 1]);
+bool homekitGroupsContain(const char *groups, const char *name, size_t length);
+
+// Handles "groups/set": takes a list as homekitGroupsParse() does, or nothing
+// to leave every group, and saves it to settings if it changed. Returns false,
+// leaving the groups alone, if it doesn't parse. Either way, settings.groups
+// is the reply for "groups".
+bool homekitGroupsConfigure(const char *list, unsigned int length, HomekitSettingsStore &store,
+                            HomekitSettings &settings, HOMEKIT_GROUPS_SUBSCRIBE_SIGNATURE resubscribe);
+// Subscribes to (or unsubscribes from) "<prefix><name>/<suffix>" for every
+// group in groups. Does nothing while disconnected, since it's done again on
+// connecting.
+void homekitGroupsSubscribe(PubSubClient &client, const char *prefix, const char *groups, const char *suffix,
+                            bool subscribe);
+
+#endif /* HOMEKIT_GROUPS_H_ */
@@ -0,0 +1,21 @@
+#include "HomekitMetrics.h"
+
+void homekitPublishTasks(HomekitScheduler &scheduler, HOMEKIT_METRIC_SIGNATURE publish) {
+  char name[32];
+  char buff[64];
+  for (uint8_t i = 0; i < scheduler.count(); i++) {
+    snprintf(name, sizeof(name), "tasks/%s", scheduler.formatStats(i, buff, sizeof(buff)));
+    publish(name, buff);
+  }
+  scheduler.resetStats();
+}
+
+void homekitPublishBootMetrics(HomekitWifi &wifi, HOMEKIT_METRIC_SIGNATURE publish) {
+  char buff[11];
+  snprintf(buff, sizeof(buff), "%lu", millis());
+  publish("boot-to-publish-ms", buff);
+
+  snprintf(buff, sizeof(buff), "%lu", wifi.connectedAt());
+  publish("wifi-ms", buff);
+  publish("wifi-fast", wifi.fastConnected() ? "1" : "0");
+}
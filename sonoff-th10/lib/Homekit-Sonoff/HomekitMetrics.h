@@ -0,0 +1,21 @@
+#ifndef HOMEKIT_METRICS_H_
+#define HOMEKIT_METRICS_H_
+
+#include <Arduino.h>
+#include <functional>
+#include "HomekitScheduler.h"
+#include "HomekitWifi.h"
+
+// Publishes one metric. name is relative to the metrics topic, e.g.
+// "wifi-ms" or "tasks/mqtt".
+#define HOMEKIT_METRIC_SIGNATURE std::function<void(const char *name, const char *value)>
+
+// Run time accounting for each task, on tasks/<name>, as "<priority> <runs>
+// <busy ms> <max us> <missed> <max late ms>". The counters restart after each
+// report, so the maximums cover the time since the last.
+void homekitPublishTasks(HomekitScheduler &scheduler, HOMEKIT_METRIC_SIGNATURE publish);
+// Measured from boot, so they show how long a power cut keeps a device away.
+// boot-to-publish-ms is taken as this, the first publish of the boot, goes out.
+void homekitPublishBootMetrics(HomekitWifi &wifi, HOMEKIT_METRIC_SIGNATURE publish);
+
+#endif /* HOMEKIT_METRICS_H_ */
@@ -0,0 +1,121 @@
+#include "HomekitQueue.h"
+#include <time.h>
+
+// SNTP gives us the real time once Wi-Fi is up; anything earlier than this
+// means the clock hasn't been set yet.
+#define HOMEKIT_QUEUE_VALID_TIME 1500000000
+
+struct HomekitQueuedMessage {
+  uint32_t time;
+  uint32_t uptime;
+  uint16_t bootId;
+  uint8_t topicLength;
+  uint8_t dataLength;
+  char text[HOMEKIT_FLASH_MAX_RECORD - 12];
+};
+
+HomekitQueue::HomekitQueue() : ring(HOMEKIT_FLASH_QUEUE, HOMEKIT_FLASH_QUEUE_SECTORS) {
+}
+
+bool HomekitQueue::begin() {
+  // Tells records from this boot apart from earlier ones, whose uptime is
+  // meaningless now.
+  bootId = random(0x10000);
+  ring.setMinEraseInterval(HOMEKIT_QUEUE_MIN_ERASE_MS);
+  if (!ring.begin()) {
+    return false;
+  }
+
+  HomekitQueuedMessage message;
+  uint32_t cursor = 0;
+  uint16_t length;
+  hasPending = ring.read(cursor, &message, sizeof(message), length);
+  return true;
+}
+
+bool HomekitQueue::push(const char *topic, const char *data) {
+  HomekitQueuedMessage message;
+  size_t topicLength = strlen(topic);
+  size_t dataLength = strlen(data);
+  if (topicLength + dataLength > sizeof(message.text)) {
+    Serial.printf("Message too large to queue: %s\n", topic);
+    return false;
+  }
+
+  time_t now = time(NULL);
+  message.time = now > HOMEKIT_QUEUE_VALID_TIME ? now : 0;
+  message.uptime = millis();
+  message.bootId = bootId;
+  message.topicLength = topicLength;
+  message.dataLength = dataLength;
+  memcpy(message.text, topic, topicLength);
+  memcpy(message.text + topicLength, data, dataLength);
+
+  if (!ring.append(&message, offsetof(HomekitQueuedMessage, text) + topicLength + dataLength)) {
+    return false;
+  }
+  hasPending = true;
+  return true;
+}
+
+bool HomekitQueue::pending() {
+  return hasPending;
+}
+
+size_t HomekitQueue::buildBatch(char *buffer, size_t size) {
+  HomekitQueuedMessage message;
+  uint32_t cursor = 0;
+  uint16_t length;
+  size_t used = 0;
+  time_t now = time(NULL);
+
+  batchEnd = 0;
+  while (true) {
+    uint32_t previous = cursor;
+    if (!ring.read(cursor, &message, sizeof(message), length)) {
+      break;
+    }
+
+    // Fill in the time for messages queued before SNTP had synced, as long
+    // as they're from this boot.
+    uint32_t when = message.time;
+    if (when == 0 && message.bootId == bootId && now > HOMEKIT_QUEUE_VALID_TIME) {
+      when = now - (millis() - message.uptime) / 1000;
+    }
+
+    int written = snprintf(buffer + used, size - used, "%u %.*s %.*s\n", when,
+                           message.topicLength, message.text,
+                           message.dataLength, message.text + message.topicLength);
+    if (written < 0 || used + written >= size) {
+      // Doesn't fit, leave it for the next batch.
+      buffer[used] = '\0';
+      cursor = previous;
+      break;
+    }
+    used += written;
+    batchEnd = cursor;
+  }
+
+  if (used == 0) {
+    hasPending = false;
+  }
+  return used;
+}
+
+void HomekitQueue::acknowledge() {
+  if (batchEnd == 0) {
+    return;
+  }
+  ring.consumeUntil(batchEnd);
+
+  // Anything pushed since the batch was built is after batchEnd.
+  HomekitQueuedMessage message;
+  uint32_t cursor = batchEnd;
+  uint16_t length;
+  hasPending = ring.read(cursor, &message, sizeof(message), length);
+  batchEnd = 0;
+}
+
+uint32_t HomekitQueue::dropped() {
+  return ring.dropped();
+}
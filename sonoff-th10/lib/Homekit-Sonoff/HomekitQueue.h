@@ -0,0 +1,43 @@
+#ifndef HOMEKIT_QUEUE_H_
+#define HOMEKIT_QUEUE_H_
+
+#include <Arduino.h>
+#include "HomekitFlash.h"
+
+// Never erase a queue sector more often than this. Sectors take turns, so
+// with 8 of them each is erased at most every 80 minutes, and a 100k cycle
+// flash lasts well over a decade even if it never stops queueing. Messages
+// pushed faster than that while offline are dropped (and counted).
+#define HOMEKIT_QUEUE_MIN_ERASE_MS  (1000UL * 60 * 10)
+
+// Messages published while the broker is unreachable, kept in a flash ring
+// along with when they were produced, and handed back in batches once it
+// is reachable again.
+//
+// A batch is only consumed once acknowledge() is called, so a batch that's
+// lost in transit is rebuilt from the same records and sent again.
+class HomekitQueue {
+  public:
+    HomekitQueue();
+
+    bool begin();
+    bool push(const char *topic, const char *data);
+    bool pending();
+
+    // Formats as many queued messages as fit into buffer, one per line:
+    //   <unix time> <topic> <payload>
+    // The time is 0 if it was never known. Returns the length written, or 0
+    // if nothing is queued.
+    size_t buildBatch(char *buffer, size_t size);
+    void acknowledge();
+
+    uint32_t dropped();
+
+  private:
+    HomekitFlashRing ring;
+    uint16_t bootId;
+    uint32_t batchEnd = 0;
+    bool hasPending = false;
+};
+
+#endif /* HOMEKIT_QUEUE_H_ */
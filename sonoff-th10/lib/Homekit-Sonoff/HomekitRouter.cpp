@@ -0,0 +1,118 @@
+#include "HomekitRouter.h"
+
+String HomekitParams::get(uint8_t index) const {
+  String result;
+  if (index >= count) {
+    return result;
+  }
+  for (uint8_t i = 0; i < length[index]; i++) {
+    result += value[index][i];
+  }
+  return result;
+}
+
+bool HomekitParams::copy(uint8_t index, char *buffer, size_t size) const {
+  if (index >= count || size <= length[index]) {
+    return false;
+  }
+  memcpy(buffer, value[index], length[index]);
+  buffer[length[index]] = '\0';
+  return true;
+}
+
+HomekitRouter::HomekitRouter() {
+  count = 0;
+  wildcards = -1;
+  for (uint8_t i = 0; i < HOMEKIT_ROUTE_BUCKETS; i++) {
+    buckets[i] = -1;
+  }
+}
+
+// 32 bit FNV-1a. Cheap, and good enough for a couple of dozen short topics.
+uint32_t HomekitRouter::hash(const char *str) {
+  uint32_t h = 2166136261UL;
+  while (*str) {
+    h ^= (uint8_t)*str++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+bool HomekitRouter::add(const char *pattern, HOMEKIT_ROUTE_SIGNATURE callback) {
+  if (count >= HOMEKIT_MAX_ROUTES || strlen(pattern) >= HOMEKIT_MAX_ROUTE_PATTERN) {
+    Serial.printf("Unable to add route, ignoring: %s\n", pattern);
+    return false;
+  }
+
+  Route &route = routes[count];
+  strcpy(route.pattern, pattern);
+  route.hash = hash(pattern);
+  route.cb = callback;
+
+  if (strchr(pattern, '+') != NULL) {
+    route.next = wildcards;
+    wildcards = count;
+  } else {
+    uint8_t bucket = route.hash & (HOMEKIT_ROUTE_BUCKETS - 1);
+    route.next = buckets[bucket];
+    buckets[bucket] = count;
+  }
+
+  count++;
+  return true;
+}
+
+bool HomekitRouter::dispatch(const char *suffix, char *payload, unsigned int length) {
+  HomekitParams params;
+  uint32_t h = hash(suffix);
+
+  for (int8_t i = buckets[h & (HOMEKIT_ROUTE_BUCKETS - 1)]; i >= 0; i = routes[i].next) {
+    if (routes[i].hash == h && strcmp(routes[i].pattern, suffix) == 0) {
+      routes[i].cb(params, payload, length);
+      return true;
+    }
+  }
+
+  for (int8_t i = wildcards; i >= 0; i = routes[i].next) {
+    params.count = 0;
+    if (match(routes[i].pattern, suffix, params)) {
+      routes[i].cb(params, payload, length);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+uint8_t HomekitRouter::size() {
+  return count;
+}
+
+const char *HomekitRouter::pattern(uint8_t index) {
+  return routes[index].pattern;
+}
+
+bool HomekitRouter::match(const char *pattern, const char *topic, HomekitParams &params) {
+  const char *p = pattern;
+  const char *t = topic;
+
+  while (*p && *t) {
+    bool segmentStart = (p == pattern || p[-1] == '/');
+    if (*p == '+' && segmentStart && (p[1] == '/' || p[1] == '\0')) {
+      const char *start = t;
+      while (*t && *t != '/') {
+        t++;
+      }
+      if (params.count < HOMEKIT_MAX_ROUTE_PARAMS) {
+        params.value[params.count] = start;
+        params.length[params.count] = t - start;
+        params.count++;
+      }
+      p++;
+    } else if (*p++ != *t++) {
+      return false;
+    }
+  }
+
+  return *p == '\0' && *t == '\0';
+}
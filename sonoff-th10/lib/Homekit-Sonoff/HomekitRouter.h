@@ -0,0 +1,63 @@
+#ifndef HOMEKIT_ROUTER_H_
+#define HOMEKIT_ROUTER_H_
+
+#include <Arduino.h>
+
+#define HOMEKIT_MAX_ROUTES        16
+#define HOMEKIT_MAX_ROUTE_PARAMS  4
+#define HOMEKIT_MAX_ROUTE_PATTERN 32
+// Must be a power of two, and comfortably larger than HOMEKIT_MAX_ROUTES so
+// that chains stay short.
+#define HOMEKIT_ROUTE_BUCKETS     32
+
+// Segments captured by '+' wildcards in a route pattern, in order. Values
+// point into the topic being dispatched and are not NUL terminated, so they
+// are only valid for the duration of the callback.
+class HomekitParams {
+  public:
+    uint8_t count = 0;
+    const char *value[HOMEKIT_MAX_ROUTE_PARAMS];
+    uint8_t length[HOMEKIT_MAX_ROUTE_PARAMS];
+
+    String get(uint8_t index) const;
+    bool copy(uint8_t index, char *buffer, size_t size) const;
+};
+
+#define HOMEKIT_ROUTE_SIGNATURE std::function<void(const HomekitParams &, char *, unsigned int)>
+
+// Routes are held in a fixed table sized at compile time, so registering one
+// never touches the heap (beyond whatever the std::function itself needs).
+//
+// Maps topic suffixes (everything after "esp/<mac>/") to callbacks. Literal
+// patterns live in a hash table and are dispatched with a single lookup;
+// patterns containing '+' segments are matched segment by segment, and only
+// when no literal route matched.
+class HomekitRouter {
+  public:
+    HomekitRouter();
+
+    bool add(const char *pattern, HOMEKIT_ROUTE_SIGNATURE callback);
+    bool dispatch(const char *suffix, char *payload, unsigned int length);
+
+    uint8_t size();
+    const char *pattern(uint8_t index);
+
+    static uint32_t hash(const char *str);
+
+  private:
+    struct Route {
+      char pattern[HOMEKIT_MAX_ROUTE_PATTERN];
+      uint32_t hash;
+      HOMEKIT_ROUTE_SIGNATURE cb;
+      int8_t next;
+    };
+
+    Route routes[HOMEKIT_MAX_ROUTES];
+    uint8_t count;
+    int8_t buckets[HOMEKIT_ROUTE_BUCKETS];
+    int8_t wildcards;
+
+    static bool match(const char *pattern, const char *topic, HomekitParams &params);
+};
+
+#endif /* HOMEKIT_ROUTER_H_ */
@@ -0,0 +1,47 @@
+#include "HomekitRtc.h"
+
+struct HomekitRtcHeader {
+  uint32_t magic;
+  uint32_t crc;
+};
+
+bool homekitRtcRead(uint32_t offset, uint32_t magic, void *data, size_t size) {
+  HomekitRtcHeader header;
+  if (!ESP.rtcUserMemoryRead(offset, (uint32_t *)&header, sizeof(header))) {
+    return false;
+  }
+  if (header.magic != magic) {
+    return false;
+  }
+  if (!ESP.rtcUserMemoryRead(offset + sizeof(header) / 4, (uint32_t *)data, size)) {
+    return false;
+  }
+  return homekitCrc32(data, size) == header.crc;
+}
+
+bool homekitRtcWrite(uint32_t offset, uint32_t magic, const void *data, size_t size) {
+  HomekitRtcHeader header;
+  header.magic = magic;
+  header.crc = homekitCrc32(data, size);
+  return ESP.rtcUserMemoryWrite(offset + sizeof(header) / 4, (uint32_t *)data, size) &&
+         ESP.rtcUserMemoryWrite(offset, (uint32_t *)&header, sizeof(header));
+}
+
+void homekitRtcClear(uint32_t offset) {
+  HomekitRtcHeader header = {0, 0};
+  ESP.rtcUserMemoryWrite(offset, (uint32_t *)&header, sizeof(header));
+}
+
+// Bitwise CRC-32 (IEEE). Slow next to a table driven version, but it only ever
+// runs over a few hundred bytes at a time and saves 1K of flash/RAM.
+uint32_t homekitCrc32(const void *data, size_t length, uint32_t crc) {
+  const uint8_t *p = (const uint8_t *)data;
+  crc = ~crc;
+  while (length--) {
+    crc ^= *p++;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320UL & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
@@ -0,0 +1,26 @@
+#ifndef HOMEKIT_RTC_H_
+#define HOMEKIT_RTC_H_
+
+#include <Arduino.h>
+
+// Layout of the 512 bytes of RTC user memory, which survive ESP.reset() and
+// deep sleep but not a power cycle. Offsets and sizes are in 4 byte blocks,
+// as ESP.rtcUserMemoryRead/Write expect.
+#define HOMEKIT_RTC_TLS_SESSION         0
+#define HOMEKIT_RTC_TLS_SESSION_BLOCKS  32
+// The rest is left for the firmware.
+#define HOMEKIT_RTC_USER                32
+#define HOMEKIT_RTC_USER_BLOCKS         96
+
+#define HOMEKIT_RTC_BLOCKS              128
+
+// Reads/writes a struct framed with a magic number and CRC32, so garbage left
+// in RTC memory after a power cycle is never mistaken for real data. size
+// must be a multiple of 4.
+bool homekitRtcRead(uint32_t offset, uint32_t magic, void *data, size_t size);
+bool homekitRtcWrite(uint32_t offset, uint32_t magic, const void *data, size_t size);
+void homekitRtcClear(uint32_t offset);
+
+uint32_t homekitCrc32(const void *data, size_t length, uint32_t crc = 0);
+
+#endif /* HOMEKIT_RTC_H_ */
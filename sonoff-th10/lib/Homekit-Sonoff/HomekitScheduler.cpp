@@ -0,0 +1,169 @@
+#include "HomekitScheduler.h"
+
+int8_t HomekitScheduler::add(const char *name, HOMEKIT_TASK_SIGNATURE task, enum HomekitTaskPriority priority,
+                             unsigned long interval, unsigned long deadline) {
+  if (taskCount >= HOMEKIT_MAX_TASKS) {
+    Serial.printf("No room to schedule %s\n", name);
+    return -1;
+  }
+
+  Task &entry = tasks[taskCount];
+  entry.callback = task;
+  entry.stats = HomekitTaskStats();
+  entry.stats.name = name;
+  entry.stats.priority = priority;
+  entry.interval = interval;
+  entry.deadline = deadline;
+  // The first run is an interval away, not straight away.
+  entry.dueAt = millis() + interval;
+  entry.ranThisPass = false;
+  return taskCount++;
+}
+
+void HomekitScheduler::setInterval(int8_t id, unsigned long interval) {
+  if (id < 0 || id >= taskCount) {
+    return;
+  }
+  tasks[id].interval = interval;
+  tasks[id].dueAt = millis() + interval;
+}
+
+void HomekitScheduler::wake(int8_t id) {
+  if (id < 0 || id >= taskCount || tasks[id].interval == 0) {
+    return;
+  }
+  tasks[id].dueAt = millis();
+}
+
+// Runs every due task once, and the urgent ones as often as there are other
+// tasks to run between. Call it from loop().
+void HomekitScheduler::run() {
+  for (uint8_t i = 0; i < taskCount; i++) {
+    tasks[i].ranThisPass = false;
+  }
+
+  int8_t id;
+  while ((id = next(millis())) >= 0) {
+    Task &task = tasks[id];
+    runTask(task, millis());
+    if (task.stats.priority != HOMEKIT_TASK_URGENT) {
+      runUrgent();
+    }
+  }
+}
+
+bool HomekitScheduler::isDue(const Task &task, uint32_t now) {
+  return task.interval == 0 || (int32_t)(now - task.dueAt) >= 0;
+}
+
+// The due task that hasn't run yet this pass with the highest priority, and
+// of those the one whose deadline comes first. Tasks without a deadline are
+// ordered as if it were their interval.
+int8_t HomekitScheduler::next(uint32_t now) {
+  int8_t best = -1;
+  uint32_t bestDeadline = 0;
+  for (uint8_t i = 0; i < taskCount; i++) {
+    const Task &task = tasks[i];
+    if (task.ranThisPass || !isDue(task, now)) {
+      continue;
+    }
+    uint32_t deadline = task.dueAt + (task.deadline != 0 ? task.deadline : task.interval);
+    if (best < 0 || task.stats.priority < tasks[best].stats.priority ||
+        (task.stats.priority == tasks[best].stats.priority && (int32_t)(deadline - bestDeadline) < 0)) {
+      best = i;
+      bestDeadline = deadline;
+    }
+  }
+  return best;
+}
+
+void HomekitScheduler::runTask(Task &task, uint32_t now) {
+  task.ranThisPass = true;
+
+  // A polled task has nothing to be late for until it's run once.
+  if (task.interval != 0 || task.stats.runs != 0) {
+    uint32_t lateness = now - task.dueAt;
+    if (task.deadline != 0 && lateness > task.deadline) {
+      task.stats.missed++;
+    }
+    if (lateness > task.stats.maxLateness) {
+      task.stats.maxLateness = lateness;
+    }
+  }
+
+  uint32_t startedAt = micros();
+  running = true;
+  task.callback();
+  running = false;
+  uint32_t elapsed = micros() - startedAt;
+
+  task.stats.runs++;
+  task.stats.busyMicros += elapsed;
+  if (elapsed > task.stats.maxMicros) {
+    task.stats.maxMicros = elapsed;
+  }
+
+  uint32_t finishedAt = millis();
+  if (task.interval == 0) {
+    task.dueAt = finishedAt;
+  } else if ((int32_t)(finishedAt - task.dueAt) < (int32_t)task.interval) {
+    task.dueAt += task.interval;
+  } else {
+    // Fell more than a whole interval behind. Keep the phase, drop the runs.
+    task.dueAt += task.interval * ((finishedAt - task.dueAt) / task.interval + 1);
+  }
+
+  if (resetPending) {
+    resetPending = false;
+    resetStats();
+  }
+}
+
+// Lets the network stack deliver anything that arrived during the last task,
+// then gives the urgent tasks a look at it.
+void HomekitScheduler::runUrgent() {
+  yield();
+  for (uint8_t i = 0; i < taskCount; i++) {
+    Task &task = tasks[i];
+    if (task.stats.priority == HOMEKIT_TASK_URGENT && isDue(task, millis())) {
+      runTask(task, millis());
+    }
+  }
+}
+
+uint8_t HomekitScheduler::count() {
+  return taskCount;
+}
+
+bool HomekitScheduler::stats(uint8_t id, HomekitTaskStats &stats) {
+  if (id >= taskCount) {
+    return false;
+  }
+  stats = tasks[id].stats;
+  return true;
+}
+
+void HomekitScheduler::resetStats() {
+  if (running) {
+    resetPending = true;
+    return;
+  }
+  for (uint8_t i = 0; i < taskCount; i++) {
+    const char *name = tasks[i].stats.name;
+    enum HomekitTaskPriority priority = tasks[i].stats.priority;
+    tasks[i].stats = HomekitTaskStats();
+    tasks[i].stats.name = name;
+    tasks[i].stats.priority = priority;
+  }
+}
+
+const char *HomekitScheduler::formatStats(uint8_t id, char *buffer, size_t size) {
+  if (id >= taskCount) {
+    return NULL;
+  }
+  const HomekitTaskStats &stats = tasks[id].stats;
+  snprintf(buffer, size, "%u %lu %lu %lu %lu %lu", stats.priority, (unsigned long)stats.runs,
+           (unsigned long)(stats.busyMicros / 1000), (unsigned long)stats.maxMicros,
+           (unsigned long)stats.missed, (unsigned long)stats.maxLateness);
+  return stats.name;
+}
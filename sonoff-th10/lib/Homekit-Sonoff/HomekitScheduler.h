@@ -0,0 +1,81 @@
+#ifndef HOMEKIT_SCHEDULER_H_
+#define HOMEKIT_SCHEDULER_H_
+
+#include <Arduino.h>
+#include <functional>
+
+#define HOMEKIT_MAX_TASKS 16
+
+#define HOMEKIT_TASK_SIGNATURE std::function<void(void)>
+
+enum HomekitTaskPriority {
+  // Commands and the I/O they arrive on. Run again between every other task.
+  HOMEKIT_TASK_URGENT,
+  HOMEKIT_TASK_NORMAL,
+  // Telemetry, history and flash housekeeping.
+  HOMEKIT_TASK_BACKGROUND,
+};
+
+struct HomekitTaskStats {
+  const char *name;
+  enum HomekitTaskPriority priority;
+  uint32_t runs;
+  uint64_t busyMicros;
+  uint32_t maxMicros;
+  // Starts later than the task's deadline allowed, and the latest start.
+  uint32_t missed;
+  uint32_t maxLateness;
+};
+
+// A cooperative scheduler for everything loop() used to poll in turn. Tasks
+// run to completion, so nothing is ever interrupted, but each pass runs the
+// due tasks highest priority first, earliest deadline first within a
+// priority, and runs due urgent tasks again after every other task. A relay
+// command waits on at most one slow task rather than on all of them.
+//
+// A task with an interval of 0 is due on every pass; otherwise it's due every
+// interval ms, skipping any runs it fell too far behind for. The deadline is
+// how late (after it's due, or for an interval of 0, after it last ran) a task
+// can start before it counts as missed. 0 means it has none.
+class HomekitScheduler {
+  public:
+    // Returns the task's id, or -1 if there's no room for it.
+    int8_t add(const char *name, HOMEKIT_TASK_SIGNATURE task, enum HomekitTaskPriority priority,
+               unsigned long interval = 0, unsigned long deadline = 0);
+    void setInterval(int8_t id, unsigned long interval);
+    // Makes a task due on the next pass.
+    void wake(int8_t id);
+    void run();
+
+    uint8_t count();
+    bool stats(uint8_t id, HomekitTaskStats &stats);
+    // Called from a task, waits until that task has returned, so its own run
+    // isn't half counted in the old figures and half in the new.
+    void resetStats();
+    // Writes "<priority> <runs> <busy ms> <max us> <missed> <max late ms>" for
+    // one task, and returns its name, or NULL if there's no such task.
+    const char *formatStats(uint8_t id, char *buffer, size_t size);
+
+  private:
+    struct Task {
+      HOMEKIT_TASK_SIGNATURE callback;
+      HomekitTaskStats stats;
+      unsigned long interval;
+      unsigned long deadline;
+      // When it's next due, or for an interval of 0, when it last ran.
+      uint32_t dueAt;
+      bool ranThisPass;
+    };
+
+    Task tasks[HOMEKIT_MAX_TASKS];
+    uint8_t taskCount = 0;
+    bool running = false;
+    bool resetPending = false;
+
+    bool isDue(const Task &task, uint32_t now);
+    int8_t next(uint32_t now);
+    void runTask(Task &task, uint32_t now);
+    void runUrgent();
+};
+
+#endif /* HOMEKIT_SCHEDULER_H_ */
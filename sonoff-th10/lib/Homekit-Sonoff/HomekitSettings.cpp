@@ -0,0 +1,138 @@
+#include "HomekitSettings.h"
+
+// Where the core's EEPROM emulation keeps its sector, from the linker script.
+extern "C" uint32_t _EEPROM_start;
+
+struct HomekitSettingsRecord {
+  uint16_t version;
+  uint16_t length;
+  uint8_t data[sizeof(HomekitSettings)];
+};
+
+// As written by EEPROM.put() in older firmware.
+struct HomekitLegacySettings {
+  uint16_t eepromSalt;
+  char mqttAddress[30];
+  char mqttUser[17];
+  char mqttPassword[17];
+  int mqttPort;
+};
+
+struct HomekitLegacyRelaySettings {
+  int salt;
+  char mqttAddress[30];
+  char mqttUser[17];
+  char mqttPassword[17];
+  int mqttPort;
+};
+
+HomekitSettingsStore::HomekitSettingsStore() : ring(HOMEKIT_FLASH_SETTINGS, HOMEKIT_FLASH_SETTINGS_SECTORS) {
+}
+
+bool HomekitSettingsStore::begin() {
+  return ring.begin();
+}
+
+// Returns false if nothing has been saved, or the settings were cleared.
+bool HomekitSettingsStore::load(HomekitSettings &settings) {
+  HomekitSettingsRecord record;
+  uint16_t length;
+  if (!ring.readLatest(&record, sizeof(record), length) || length < offsetof(HomekitSettingsRecord, data) ||
+      record.version == 0) {
+    return false;
+  }
+  if (record.version > HOMEKIT_SETTINGS_VERSION) {
+    Serial.printf("Settings are from newer firmware (version %u), ignoring them\n", record.version);
+    return false;
+  }
+
+  HomekitSettings defaults;
+  settings = defaults;
+  uint16_t size = length - offsetof(HomekitSettingsRecord, data);
+  memcpy(&settings, record.data, size < sizeof(settings) ? size : sizeof(settings));
+
+  // Migrations from older versions go here, oldest first.
+  switch (record.version) {
+    case 1:
+      // Added localKey, which the defaults already cover.
+    case 2:
+      // Added groups, likewise.
+    case HOMEKIT_SETTINGS_VERSION:
+      break;
+  }
+  return true;
+}
+
+bool HomekitSettingsStore::save(const HomekitSettings &settings) {
+  HomekitSettingsRecord record;
+  record.version = HOMEKIT_SETTINGS_VERSION;
+  record.length = sizeof(settings);
+  memcpy(record.data, &settings, sizeof(settings));
+  return ring.append(&record, sizeof(record));
+}
+
+// Leaves a record with no settings in it, which load() treats as none, and
+// which keeps migrateEeprom() from bringing the EEPROM settings back.
+void HomekitSettingsStore::clear() {
+  HomekitSettingsRecord record;
+  record.version = 0;
+  record.length = 0;
+  ring.append(&record, offsetof(HomekitSettingsRecord, data));
+}
+
+// Reads settings an older firmware left in EEPROM straight out of flash, and
+// saves them to the store. salt is whatever the firmware used to validate
+// them. The EEPROM itself is left alone, so this only happens while the store
+// is empty: once anything has been written to it, including the record
+// clear() leaves, the EEPROM copy is stale and a factory reset has to stick.
+bool HomekitSettingsStore::migrateEeprom(enum HomekitLegacyLayout layout, uint32_t salt, HomekitSettings &settings) {
+  static_assert(sizeof(HomekitLegacySettings) % 4 == 0 && sizeof(HomekitLegacyRelaySettings) % 4 == 0,
+                "Legacy settings must be read in whole words");
+  HomekitSettingsRecord record;
+  uint16_t length;
+  if (ring.readLatest(&record, sizeof(record), length)) {
+    return false;
+  }
+  uint32_t address = (uintptr_t)&_EEPROM_start - 0x40200000;
+  HomekitSettings migrated;
+
+  if (layout == HOMEKIT_LEGACY_HOMEKIT) {
+    HomekitLegacySettings legacy;
+    if (!ESP.flashRead(address, (uint32_t *)&legacy, sizeof(legacy)) || legacy.eepromSalt != salt) {
+      return false;
+    }
+    memcpy(migrated.mqttAddress, legacy.mqttAddress, sizeof(migrated.mqttAddress));
+    memcpy(migrated.mqttUser, legacy.mqttUser, sizeof(migrated.mqttUser));
+    memcpy(migrated.mqttPassword, legacy.mqttPassword, sizeof(migrated.mqttPassword));
+    migrated.mqttPort = legacy.mqttPort;
+  } else {
+    HomekitLegacyRelaySettings legacy;
+    if (!ESP.flashRead(address, (uint32_t *)&legacy, sizeof(legacy)) || (uint32_t)legacy.salt != salt) {
+      return false;
+    }
+    memcpy(migrated.mqttAddress, legacy.mqttAddress, sizeof(migrated.mqttAddress));
+    memcpy(migrated.mqttUser, legacy.mqttUser, sizeof(migrated.mqttUser));
+    memcpy(migrated.mqttPassword, legacy.mqttPassword, sizeof(migrated.mqttPassword));
+    migrated.mqttPort = legacy.mqttPort;
+  }
+
+  // Strings were written by strcpy() from bounded inputs, but make sure.
+  migrated.mqttAddress[sizeof(migrated.mqttAddress) - 1] = '\0';
+  migrated.mqttUser[sizeof(migrated.mqttUser) - 1] = '\0';
+  migrated.mqttPassword[sizeof(migrated.mqttPassword) - 1] = '\0';
+
+  Serial.println("Migrating settings from EEPROM");
+  settings = migrated;
+  save(settings);
+  return true;
+}
+
+bool HomekitSettingsStore::saveLocalKey(HomekitSettings &settings, const char *key, unsigned int length) {
+  if (length >= sizeof(settings.localKey)) {
+    return false;
+  }
+  memcpy(settings.localKey, key, length);
+  settings.localKey[length] = '\0';
+  save(settings);
+  return true;
+}
@@ -0,0 +1,52 @@
+#ifndef HOMEKIT_SETTINGS_H_
+#define HOMEKIT_SETTINGS_H_
+
+#include <Arduino.h>
+#include "HomekitFlash.h"
+
+// Bump when HomekitSettings changes. New fields go on the end, so records
+// written by older firmware are read with the new fields left at their
+// defaults; anything else needs a case in HomekitSettingsStore::load().
+#define HOMEKIT_SETTINGS_VERSION 3
+
+struct HomekitSettings {
+  char mqttAddress[30] = "";
+  char mqttUser[17] = "";
+  char mqttPassword[17] = "";
+  uint16_t mqttPort = 8883;
+  uint16_t reserved = 0;
+  // Shared key for local control outside the broker. Empty turns it off.
+  char localKey[33] = "";
+  // Groups this device also takes commands for, separated by spaces. See
+  // HomekitGroups.h.
+  char groups[64] = "";
+};
+
+// The two ways settings used to be laid out in EEPROM, so they can be
+// migrated on the first boot of newer firmware.
+enum HomekitLegacyLayout {
+  HOMEKIT_LEGACY_HOMEKIT,  // uint16_t salt, from Homekit-Sonoff
+  HOMEKIT_LEGACY_RELAY,    // int salt, from the relay firmware
+};
+
+// Settings kept as versioned records in a HomekitFlashRing rather than in the
+// emulated EEPROM. Every save appends a new CRC checked record and the newest
+// intact one wins, so a save cut short by a power loss leaves the previous
+// settings in place, and writes are spread over both sectors.
+class HomekitSettingsStore {
+  public:
+    HomekitSettingsStore();
+
+    bool begin();
+    bool load(HomekitSettings &settings);
+    bool save(const HomekitSettings &settings);
+    void clear();
+    // Sets and saves the shared local key, or returns false if it's too long.
+    bool saveLocalKey(HomekitSettings &settings, const char *key, unsigned int length);
+    bool migrateEeprom(enum HomekitLegacyLayout layout, uint32_t salt, HomekitSettings &settings);
+
+  private:
+    HomekitFlashRing ring;
+};
+
+#endif /* HOMEKIT_SETTINGS_H_ */
@@ -0,0 +1,205 @@
+#include "HomekitWifi.h"
+#include <ESP8266WiFi.h>
+#include "HomekitRtc.h"
+
+HomekitWifi::HomekitWifi(bool askForLocalKey) : cache(HOMEKIT_FLASH_WIFI, HOMEKIT_FLASH_WIFI_SECTORS) {
+  this->askForLocalKey = askForLocalKey;
+}
+
+void HomekitWifi::begin(const HomekitSettings &settings, HOMEKIT_ON_PORTAL_SIGNATURE onPortal) {
+  onPortalCallback = onPortal;
+  cache.begin();
+
+  wifiManager.setAPCallback([this](WiFiManager *wifi) {
+    Serial.println("Entered config mode");
+    Serial.println(WiFi.softAPIP());
+    //if you used auto generated SSID, print it
+    Serial.println(wifi->getConfigPortalSSID());
+    if (onPortalCallback != NULL) {
+      onPortalCallback();
+    }
+  });
+  // The portal is serviced from tick(), so the device keeps working
+  // while it's up, and it stays up until it's configured rather than
+  // rebooting.
+  wifiManager.setConfigPortalBlocking(false);
+  // Bounds how long autoConnect() waits on the saved network before starting
+  // the portal.
+  wifiManager.setConnectTimeout(10);
+
+  mqttServerAddress.setValue(settings.mqttAddress, 30);
+  mqttServerPort.setValue(String(settings.mqttPort).c_str(), 6);
+  mqttUsername.setValue(settings.mqttUser, 16);
+  mqttPassword.setValue(settings.mqttPassword, 16);
+  wifiManager.addParameter(&mqttServerAddress);
+  wifiManager.addParameter(&mqttServerPort);
+  wifiManager.addParameter(&mqttUsername);
+  wifiManager.addParameter(&mqttPassword);
+  if (askForLocalKey) {
+    localKey.setValue(settings.localKey, 32);
+    wifiManager.addParameter(&localKey);
+  }
+
+  wifiManager.setSaveConfigCallback([this]() {
+    Serial.println("Should save config");
+    shouldSaveConfig = true;
+  });
+}
+
+bool HomekitWifi::connect(const char *hostname, bool useCache) {
+  if (useCache && fastConnect()) {
+    Serial.println("Connected to cached access point");
+    wifiFastConnected = true;
+    return true;
+  }
+  if (wifiManager.autoConnect(hostname)) {
+    return true;
+  }
+  Serial.println("Config portal started, carrying on without Wi-Fi");
+  portalStarted = true;
+  portalRetryAt = millis() + HOMEKIT_PORTAL_RETRY_MS;
+  return false;
+}
+
+bool HomekitWifi::portalActive() {
+  return portalStarted;
+}
+
+// While the portal is up, keep retrying the saved network now and again, so a
+// device that booted before its access point did comes back by itself. Each
+// retry briefly takes the portal's channel with it.
+bool HomekitWifi::tick() {
+  if (leaseRenewed) {
+    leaseRenewed = false;
+    leaseHandler = NULL;
+    Serial.print("DHCP lease renewed: ");
+    Serial.println(WiFi.localIP());
+    saveCache();
+  }
+  if (!portalStarted) {
+    return false;
+  }
+  bool configuredNow = wifiManager.process();
+  if (!configuredNow && WiFi.status() != WL_CONNECTED) {
+    if ((long)(millis() - portalRetryAt) >= 0 && WiFi.SSID().length() != 0) {
+      Serial.println("Retrying saved access point");
+      WiFi.begin();
+      portalRetryAt = millis() + HOMEKIT_PORTAL_RETRY_MS;
+    }
+    return false;
+  }
+
+  if (!configuredNow) {
+    wifiManager.stopConfigPortal();
+  }
+  portalStarted = false;
+  return true;
+}
+
+// Runs once Wi-Fi is up, whether straight away or later from the portal.
+bool HomekitWifi::connected(HomekitSettingsStore &store, HomekitSettings &settings) {
+  wifiConnectedAt = millis();
+  if (wifiFastConnected && leaseHandler == NULL) {
+    renewLease();
+  } else {
+    saveCache();
+  }
+
+  bool saved = shouldSaveConfig;
+  if (shouldSaveConfig) {
+    Serial.println("Saving config");
+    shouldSaveConfig = false;
+
+    strcpy(settings.mqttAddress, mqttServerAddress.getValue());
+    strcpy(settings.mqttUser, mqttUsername.getValue());
+    strcpy(settings.mqttPassword, mqttPassword.getValue());
+    settings.mqttPort = atoi(mqttServerPort.getValue());
+    if (askForLocalKey) {
+      strcpy(settings.localKey, localKey.getValue());
+    }
+    store.save(settings);
+  }
+
+  Serial.printf("settings.mqttAddress: '%s'\n", settings.mqttAddress);
+  Serial.printf("settings.mqttPort: '%d'\n", settings.mqttPort);
+  Serial.printf("settings.mqttUser: '%s'\n", settings.mqttUser);
+  Serial.printf("settings.mqttPassword: '%s'\n", settings.mqttPassword);
+  return saved;
+}
+
+unsigned long HomekitWifi::connectedAt() {
+  return wifiConnectedAt;
+}
+
+bool HomekitWifi::fastConnected() {
+  return wifiFastConnected;
+}
+
+// Joins the access point we last used directly, on its channel and with the
+// IP configuration DHCP gave us then. This skips the scan and the DHCP
+// exchange, which is most of the time it takes to get on the network. If the
+// access point has moved on, we're back to WiFiManager within a few seconds.
+bool HomekitWifi::fastConnect() {
+  String ssid = WiFi.SSID();
+  String psk = WiFi.psk();
+  HomekitWifiCache cached;
+  uint16_t length;
+  if (ssid.length() == 0 || !cache.readLatest(&cached, sizeof(cached), length) ||
+      length != sizeof(cached) || cached.ssidHash != homekitCrc32(ssid.c_str(), ssid.length())) {
+    return false;
+  }
+
+  // Keep the BSSID and static IP out of the SDK's saved config, or they'd
+  // stick to the WiFiManager fallback too.
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.config(IPAddress(cached.ip), IPAddress(cached.gateway), IPAddress(cached.subnet), IPAddress(cached.dns));
+  WiFi.begin(ssid.c_str(), psk.c_str(), cached.channel, cached.bssid);
+  WiFi.persistent(true);
+
+  unsigned long started = millis();
+  while (WiFi.status() != WL_CONNECTED) {
+    if (millis() - started >= HOMEKIT_FAST_CONNECT_TIMEOUT_MS) {
+      Serial.println("Cached access point unavailable, scanning");
+      WiFi.config(IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0));
+      return false;
+    }
+    delay(10);
+  }
+  return true;
+}
+
+// The fast connect reused the cached lease as a static configuration, which
+// the DHCP server knows nothing about. Going back to DHCP keeps the address
+// while the server is asked, and the lease it grants is cached by tick() for
+// the next boot.
+void HomekitWifi::renewLease() {
+  leaseHandler = WiFi.onStationModeGotIP([this](const WiFiEventStationModeGotIP &event) {
+    leaseRenewed = true;
+  });
+  WiFi.config(IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0));
+}
+
+// Only written when something changed, which for a device that stays put is
+// hardly ever.
+void HomekitWifi::saveCache() {
+  HomekitWifiCache current;
+  memset(&current, 0, sizeof(current));
+  String ssid = WiFi.SSID();
+  current.ssidHash = homekitCrc32(ssid.c_str(), ssid.length());
+  memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+  current.channel = WiFi.channel();
+  current.ip = WiFi.localIP();
+  current.gateway = WiFi.gatewayIP();
+  current.subnet = WiFi.subnetMask();
+  current.dns = WiFi.dnsIP();
+
+  HomekitWifiCache previous;
+  uint16_t length;
+  if (cache.readLatest(&previous, sizeof(previous), length) && length == sizeof(previous) &&
+      memcmp(&previous, &current, sizeof(current)) == 0) {
+    return;
+  }
+  Serial.println("Saving access point to cache");
+  cache.append(&current, sizeof(current));
+}
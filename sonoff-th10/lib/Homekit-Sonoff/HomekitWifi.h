@@ -0,0 +1,81 @@
+#ifndef HOMEKIT_WIFI_H_
+#define HOMEKIT_WIFI_H_
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiManager.h>
+#include <functional>
+#include "HomekitFlash.h"
+#include "HomekitSettings.h"
+
+// How long to wait on the cached access point before falling back to
+// WiFiManager and a full scan.
+#define HOMEKIT_FAST_CONNECT_TIMEOUT_MS 3000
+
+// How often to retry the saved access point while the config portal is up.
+#define HOMEKIT_PORTAL_RETRY_MS 60000
+
+#define HOMEKIT_ON_PORTAL_SIGNATURE std::function<void(void)>
+
+// The access point and IP configuration we last connected with, so the next
+// boot can skip the scan and the DHCP exchange. Only a hash of the SSID is
+// kept; the SDK has the SSID itself. The lease is renewed in the background
+// after each fast connect, so it's never more than a boot out of date.
+struct HomekitWifiCache {
+  uint32_t ssidHash;
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t reserved;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+// Getting on the network, for both firmwares: the cached access point first,
+// then WiFiManager's saved one, and failing that a config portal asking for
+// the MQTT settings (and the local key, if asked for). The portal doesn't
+// block; tick() services it and reports when Wi-Fi comes up.
+class HomekitWifi {
+  public:
+    HomekitWifi(bool askForLocalKey = false);
+
+    void begin(const HomekitSettings &settings, HOMEKIT_ON_PORTAL_SIGNATURE onPortal);
+    // Returns false if the config portal had to be started instead.
+    bool connect(const char *hostname, bool useCache);
+    bool portalActive();
+    // Call on every pass. Returns true once, when Wi-Fi comes up while the
+    // portal is active.
+    bool tick();
+    // Call once Wi-Fi is up. Saves anything entered in the portal into
+    // settings and store, returning true if there was.
+    bool connected(HomekitSettingsStore &store, HomekitSettings &settings);
+
+    unsigned long connectedAt();
+    bool fastConnected();
+
+  private:
+    HomekitFlashRing cache;
+    WiFiManager wifiManager;
+    WiFiManagerParameter mqttServerAddress{"mqtt-server-address", "MQTT Server Address", "", 30};
+    WiFiManagerParameter mqttServerPort{"mqtt-server-port", "MQTT Server Port", "", 6};
+    WiFiManagerParameter mqttUsername{"mqtt-username", "MQTT User", "", 16};
+    WiFiManagerParameter mqttPassword{"mqtt-password", "MQTT Password", "", 16};
+    WiFiManagerParameter localKey{"local-key", "Local Control Key", "", 32};
+    bool askForLocalKey;
+    HOMEKIT_ON_PORTAL_SIGNATURE onPortalCallback;
+
+    bool shouldSaveConfig = false;
+    bool portalStarted = false;
+    unsigned long portalRetryAt = 0;
+    unsigned long wifiConnectedAt = 0;
+    bool wifiFastConnected = false;
+    WiFiEventHandler leaseHandler;
+    volatile bool leaseRenewed = false;
+
+    bool fastConnect();
+    void renewLease();
+    void saveCache();
+};
+
+#endif /* HOMEKIT_WIFI_H_ */
@@ -0,0 +1,102 @@
+#include "HomekitWriteBuffer.h"
+
+HomekitWriteBuffer::HomekitWriteBuffer(Client &client) : client(client) {
+}
+
+void HomekitWriteBuffer::setPassthrough(bool passthrough) {
+  if (passthrough) {
+    send();
+  }
+  this->passthrough = passthrough;
+}
+
+size_t HomekitWriteBuffer::pending() {
+  return length;
+}
+
+unsigned long HomekitWriteBuffer::pendingSince() {
+  return firstWriteAt;
+}
+
+int HomekitWriteBuffer::connect(IPAddress ip, uint16_t port) {
+  length = 0;
+  return client.connect(ip, port);
+}
+
+int HomekitWriteBuffer::connect(const char *host, uint16_t port) {
+  length = 0;
+  return client.connect(host, port);
+}
+
+size_t HomekitWriteBuffer::write(uint8_t b) {
+  return write(&b, 1);
+}
+
+size_t HomekitWriteBuffer::write(const uint8_t *buf, size_t size) {
+  if (passthrough) {
+    return client.write(buf, size);
+  }
+
+  if (length + size > sizeof(buffer)) {
+    send();
+  }
+  if (size > sizeof(buffer)) {
+    return client.write(buf, size);
+  }
+
+  if (length == 0) {
+    firstWriteAt = millis();
+  }
+  memcpy(buffer + length, buf, size);
+  length += size;
+  return size;
+}
+
+int HomekitWriteBuffer::available() {
+  return client.available();
+}
+
+int HomekitWriteBuffer::read() {
+  return client.read();
+}
+
+int HomekitWriteBuffer::read(uint8_t *buf, size_t size) {
+  return client.read(buf, size);
+}
+
+int HomekitWriteBuffer::peek() {
+  return client.peek();
+}
+
+void HomekitWriteBuffer::flush() {
+  send();
+  client.flush();
+}
+
+void HomekitWriteBuffer::stop() {
+  length = 0;
+  client.stop();
+}
+
+uint8_t HomekitWriteBuffer::connected() {
+  return client.connected();
+}
+
+HomekitWriteBuffer::operator bool() {
+  return (bool)client;
+}
+
+void HomekitWriteBuffer::send() {
+  if (length == 0) {
+    return;
+  }
+  size_t written = client.write(buffer, length);
+  if (written != length) {
+    // The rest of a packet can't follow later without misframing everything
+    // after it, and PubSubClient already counted it as sent. Drop the
+    // connection instead, so PubSubClient sees it gone and reconnects.
+    Serial.printf("Short write flushing MQTT buffer: %u of %u bytes, disconnecting\n", written, length);
+    client.stop();
+  }
+  length = 0;
+}
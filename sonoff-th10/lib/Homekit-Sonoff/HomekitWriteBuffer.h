@@ -0,0 +1,51 @@
+#ifndef HOMEKIT_WRITE_BUFFER_H_
+#define HOMEKIT_WRITE_BUFFER_H_
+
+#include <Arduino.h>
+#include <Client.h>
+
+// Matches BearSSL's default outbound record size, so a full buffer still
+// leaves as a single TLS record.
+#ifndef HOMEKIT_WRITE_BUFFER_SIZE
+#define HOMEKIT_WRITE_BUFFER_SIZE 512
+#endif
+
+// A Client that sits between PubSubClient and the network client and holds
+// on to outbound packets until flush() is called (or the buffer fills), so
+// that several MQTT packets leave as one TLS record and one TCP segment.
+//
+// Reads pass straight through and do not flush. Anything that waits for a
+// reply to something it just wrote (e.g. CONNECT/CONNACK) must run with
+// passthrough enabled.
+class HomekitWriteBuffer : public Client {
+  public:
+    HomekitWriteBuffer(Client &client);
+
+    void setPassthrough(bool passthrough);
+    size_t pending();
+    unsigned long pendingSince();
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char *host, uint16_t port);
+    size_t write(uint8_t b);
+    size_t write(const uint8_t *buf, size_t size);
+    int available();
+    int read();
+    int read(uint8_t *buf, size_t size);
+    int peek();
+    void flush();
+    void stop();
+    uint8_t connected();
+    operator bool();
+
+  private:
+    Client &client;
+    uint8_t buffer[HOMEKIT_WRITE_BUFFER_SIZE];
+    size_t length = 0;
+    unsigned long firstWriteAt = 0;
+    bool passthrough = false;
+
+    void send();
+};
+
+#endif /* HOMEKIT_WRITE_BUFFER_H_ */
@@ -0,0 +1,105 @@
+#include "Reading-History.h"
+
+ReadingHistory::ReadingHistory(uint8_t resolution) {
+  step = resolution == 0 ? 1 : resolution;
+}
+
+uint32_t ReadingHistory::sequence() {
+  return nextSequence;
+}
+
+uint8_t ReadingHistory::resolution() {
+  return step;
+}
+
+void ReadingHistory::add(int16_t humidity, int16_t temperature) {
+  // Round to the storage resolution.
+  int16_t h = (humidity + (humidity < 0 ? -step : step) / 2) / step;
+  int16_t t = (temperature + (temperature < 0 ? -step : step) / 2) / step;
+
+  if (used == 0) {
+    used = 1;
+    startBlock(h, t);
+  } else {
+    HistoryBlock &block = blocks[current];
+    uint8_t encoded[7];
+    uint8_t length = encode(h - lastHumidity, t - lastTemperature, encoded);
+
+    if (block.count == 255 || block.length + length > HISTORY_BLOCK_DATA) {
+      current = (current + 1) % HISTORY_BLOCKS;
+      if (used < HISTORY_BLOCKS) {
+        used++;
+      }
+      startBlock(h, t);
+    } else {
+      memcpy(block.data + block.length, encoded, length);
+      block.length += length;
+      block.count++;
+    }
+  }
+
+  lastHumidity = h;
+  lastTemperature = t;
+  nextSequence++;
+}
+
+void ReadingHistory::startBlock(int16_t humidity, int16_t temperature) {
+  HistoryBlock &block = blocks[current];
+  block.firstSequence = nextSequence;
+  block.humidity = humidity;
+  block.temperature = temperature;
+  block.count = 1;
+  block.length = 0;
+}
+
+uint8_t ReadingHistory::oldest() {
+  return (current + HISTORY_BLOCKS + 1 - used) % HISTORY_BLOCKS;
+}
+
+uint8_t ReadingHistory::beginStream(uint32_t since) {
+  streamRemaining = 0;
+  for (uint8_t i = 0; i < used; i++) {
+    uint8_t index = (oldest() + i) % HISTORY_BLOCKS;
+    HistoryBlock &block = blocks[index];
+    if (block.firstSequence + block.count > since) {
+      streamNext = index;
+      streamRemaining = used - i;
+      break;
+    }
+  }
+  return streamRemaining;
+}
+
+bool ReadingHistory::streaming() {
+  return streamRemaining > 0;
+}
+
+const HistoryBlock *ReadingHistory::nextChunk() {
+  if (streamRemaining == 0) {
+    return NULL;
+  }
+  const HistoryBlock *block = &blocks[streamNext];
+  streamNext = (streamNext + 1) % HISTORY_BLOCKS;
+  streamRemaining--;
+  return block;
+}
+
+uint8_t ReadingHistory::encode(int32_t dh, int32_t dt, uint8_t *out) {
+  if (dh >= -7 && dh <= 7 && dt >= -7 && dt <= 7) {
+    out[0] = ((dh + 8) << 4) | (dt + 8);
+    return 1;
+  }
+
+  uint8_t length = 0;
+  out[length++] = 0x00;
+  int32_t deltas[2] = {dh, dt};
+  for (uint8_t i = 0; i < 2; i++) {
+    uint32_t zigzag = ((uint32_t)deltas[i] << 1) ^ (uint32_t)(deltas[i] >> 31);
+    do {
+      uint8_t b = zigzag & 0x7F;
+      zigzag >>= 7;
+      out[length++] = zigzag != 0 ? (b | 0x80) : b;
+    } while (zigzag != 0);
+  }
+  return length;
+}
@@ -0,0 +1,71 @@
+#ifndef READING_HISTORY_H_
+#define READING_HISTORY_H_
+
+#include <Arduino.h>
+
+#ifndef HISTORY_BLOCKS
+#define HISTORY_BLOCKS 16
+#endif
+// Keeps a whole block plus topic and MQTT headers inside PubSubClient's
+// default 128 byte packet buffer, so a block can be published as is.
+#define HISTORY_BLOCK_DATA 54
+
+// A block of delta encoded samples, published verbatim as one chunk of the
+// history stream. Little endian, no padding:
+//
+//   uint32  firstSequence  sequence number of the keyframe sample
+//   int16   humidity       keyframe values, in units of resolution
+//   int16   temperature
+//   uint8   count          samples in this block, keyframe included
+//   uint8   length         bytes of data used
+//   uint8   data[54]
+//
+// Each following sample is the difference from the one before it. When both
+// deltas fit in -7..7 the sample is a single byte, (dh + 8) << 4 | (dt + 8).
+// Otherwise it is 0x00 followed by dh and dt as zigzag varints.
+struct HistoryBlock {
+  uint32_t firstSequence;
+  int16_t humidity;
+  int16_t temperature;
+  uint8_t count;
+  uint8_t length;
+  uint8_t data[HISTORY_BLOCK_DATA];
+};
+
+// A compact ring of the last several hours of readings. Samples are stored
+// at a reduced resolution (hundredths / resolution) and delta encoded into
+// fixed size blocks; once every block is full, the oldest is dropped whole.
+//
+// Samples are numbered by a sequence that counts up from boot, so a reader
+// can place them in time from the current sequence and the sample interval.
+class ReadingHistory {
+  public:
+    ReadingHistory(uint8_t resolution);
+
+    void add(int16_t humidity, int16_t temperature);
+    uint32_t sequence();
+    uint8_t resolution();
+
+    // Streams the blocks holding samples at or after since, oldest first.
+    uint8_t beginStream(uint32_t since);
+    bool streaming();
+    const HistoryBlock *nextChunk();
+
+  private:
+    HistoryBlock blocks[HISTORY_BLOCKS];
+    uint8_t current = 0;
+    uint8_t used = 0;
+    uint32_t nextSequence = 0;
+    uint8_t step;
+    int16_t lastHumidity;
+    int16_t lastTemperature;
+
+    uint8_t streamNext = 0;
+    uint8_t streamRemaining = 0;
+
+    void startBlock(int16_t humidity, int16_t temperature);
+    uint8_t oldest();
+    static uint8_t encode(int32_t dh, int32_t dt, uint8_t *out);
+};
+
+#endif /* READING_HISTORY_H_ */
@@ -0,0 +1,447 @@
+#include "Rule-Engine.h"
+
+// A tokenizer and single pass compiler over the rule text. Everything is
+// emitted straight into a scratch buffer, which only replaces the running
+// program once the whole source has compiled.
+class RuleCompiler {
+  public:
+    RuleCompiler(const char *source, unsigned int length) : source(source), end(length) {
+    }
+
+    bool compile();
+
+    uint8_t code[RULE_MAX_PROGRAM];
+    uint16_t length = 0;
+    uint8_t rules = 0;
+    const char *error = NULL;
+    uint16_t errorAt = 0;
+
+  private:
+    const char *source;
+    unsigned int end;
+    unsigned int position = 0;
+    uint8_t timers = 0;
+
+    const char *token;
+    unsigned int tokenLength;
+
+    bool next();
+    bool is(const char *word);
+    bool expect(const char *word);
+    bool fail(const char *message);
+    bool emit(uint8_t byte);
+    bool emitInt(uint32_t value, uint8_t bytes);
+
+    bool rule();
+    bool condition(uint8_t &channel, uint8_t &op, int32_t &value);
+    bool number(int32_t &value, uint8_t decimals);
+    bool separator();
+};
+
+static bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Tokens are words, numbers, comparison operators and separators.
+bool RuleCompiler::next() {
+  while (position < end && isSpace(source[position])) {
+    position++;
+  }
+  token = source + position;
+  tokenLength = 0;
+  if (position >= end) {
+    return false;
+  }
+
+  char c = source[position];
+  if (c == ';' || c == '\n') {
+    tokenLength = 1;
+  } else if (c == '<' || c == '>') {
+    tokenLength = position + 1 < end && source[position + 1] == '=' ? 2 : 1;
+  } else {
+    while (position + tokenLength < end) {
+      char d = source[position + tokenLength];
+      if (isSpace(d) || d == ';' || d == '\n' || d == '<' || d == '>') {
+        break;
+      }
+      tokenLength++;
+    }
+  }
+  position += tokenLength;
+  return true;
+}
+
+bool RuleCompiler::is(const char *word) {
+  return strlen(word) == tokenLength && strncmp(token, word, tokenLength) == 0;
+}
+
+bool RuleCompiler::expect(const char *word) {
+  if (!is(word)) {
+    return fail(word);
+  }
+  next();
+  return true;
+}
+
+bool RuleCompiler::fail(const char *message) {
+  if (error == NULL) {
+    error = message;
+    errorAt = token - source;
+  }
+  return false;
+}
+
+bool RuleCompiler::emit(uint8_t byte) {
+  if (length >= sizeof(code)) {
+    return fail("program too long");
+  }
+  code[length++] = byte;
+  return true;
+}
+
+bool RuleCompiler::emitInt(uint32_t value, uint8_t bytes) {
+  for (uint8_t i = 0; i < bytes; i++) {
+    if (!emit(value >> (i * 8))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RuleCompiler::compile() {
+  next();
+  while (tokenLength != 0) {
+    if (is(";") || is("\n")) {
+      next();
+      continue;
+    }
+    if (!rule()) {
+      return false;
+    }
+    rules++;
+  }
+  return true;
+}
+
+bool RuleCompiler::rule() {
+  uint8_t channel;
+  uint8_t op;
+  int32_t value;
+  uint8_t conditions = 0;
+
+  do {
+    if (conditions != 0) {
+      next();
+    }
+    if (!condition(channel, op, value)) {
+      return false;
+    }
+    if (conditions != 0 && !emit(RULE_OP_AND)) {
+      return false;
+    }
+    conditions++;
+  } while (is("and"));
+
+  if (is("for")) {
+    next();
+    int32_t seconds;
+    if (!number(seconds, 0) || seconds < 0 || seconds > 0xffff) {
+      return fail("duration");
+    }
+    if (timers == RULE_MAX_TIMERS) {
+      return fail("too many timers");
+    }
+    if (!emit(RULE_OP_FOR) || !emit(timers++) || !emitInt(seconds, 2)) {
+      return false;
+    }
+  }
+
+  int32_t hysteresis = -1;
+  if (is("hysteresis")) {
+    if (conditions != 1) {
+      return fail("hysteresis needs a single condition");
+    }
+    next();
+    if (!number(hysteresis, 2) || hysteresis < 0) {
+      return fail("hysteresis");
+    }
+  }
+
+  if (!expect("then")) {
+    return false;
+  }
+  uint8_t action;
+  if (is("on")) {
+    action = RULE_ACTION_ON;
+  } else if (is("off")) {
+    action = RULE_ACTION_OFF;
+  } else {
+    return fail("on or off");
+  }
+  next();
+  if (!emit(RULE_OP_THEN) || !emit(action)) {
+    return false;
+  }
+
+  // Hysteresis adds the opposite rule, with its threshold moved back by
+  // that much.
+  if (hysteresis >= 0) {
+    bool above = op == RULE_OP_GT || op == RULE_OP_GE;
+    if (!emit(RULE_OP_LOAD) || !emit(channel) ||
+        !emit(RULE_OP_CONST) || !emitInt(above ? value - hysteresis : value + hysteresis, 4) ||
+        !emit(above ? RULE_OP_LT : RULE_OP_GT) ||
+        !emit(RULE_OP_THEN) || !emit(action == RULE_ACTION_ON ? RULE_ACTION_OFF : RULE_ACTION_ON)) {
+      return false;
+    }
+    rules++;
+  }
+
+  return separator();
+}
+
+bool RuleCompiler::condition(uint8_t &channel, uint8_t &op, int32_t &value) {
+  if (is("humidity")) {
+    channel = RULE_CHANNEL_HUMIDITY;
+  } else if (is("temperature")) {
+    channel = RULE_CHANNEL_TEMPERATURE;
+  } else {
+    return fail("humidity or temperature");
+  }
+  next();
+
+  if (is(">")) {
+    op = RULE_OP_GT;
+  } else if (is("<")) {
+    op = RULE_OP_LT;
+  } else if (is(">=")) {
+    op = RULE_OP_GE;
+  } else if (is("<=")) {
+    op = RULE_OP_LE;
+  } else {
+    return fail("comparison");
+  }
+  next();
+
+  if (!number(value, 2)) {
+    return fail("value");
+  }
+  return emit(RULE_OP_LOAD) && emit(channel) && emit(RULE_OP_CONST) && emitInt(value, 4) && emit(op);
+}
+
+// Parses the current token as a decimal with up to the given number of
+// decimals, scaled to an integer.
+bool RuleCompiler::number(int32_t &value, uint8_t decimals) {
+  unsigned int i = 0;
+  bool negative = tokenLength > 0 && token[0] == '-';
+  if (negative) {
+    i++;
+  }
+
+  int32_t result = 0;
+  int8_t fraction = -1;
+  bool digits = false;
+  for (; i < tokenLength; i++) {
+    char c = token[i];
+    if (c == '.' && fraction < 0 && decimals != 0) {
+      fraction = 0;
+    } else if (c >= '0' && c <= '9' && fraction < decimals && result < 10000000) {
+      result = result * 10 + (c - '0');
+      digits = true;
+      if (fraction >= 0) {
+        fraction++;
+      }
+    } else {
+      return false;
+    }
+  }
+  if (!digits) {
+    return false;
+  }
+  for (int8_t j = fraction < 0 ? 0 : fraction; j < decimals; j++) {
+    result *= 10;
+  }
+  value = negative ? -result : result;
+  next();
+  return true;
+}
+
+bool RuleCompiler::separator() {
+  if (tokenLength == 0) {
+    return true;
+  }
+  if (is(";") || is("\n")) {
+    next();
+    return true;
+  }
+  return fail("end of rule");
+}
+
+bool RuleEngine::compile(const char *source, unsigned int sourceLength) {
+  RuleCompiler compiler(source, sourceLength);
+  if (!compiler.compile()) {
+    errorMessage = compiler.error;
+    errorPosition = compiler.errorAt;
+    return false;
+  }
+  errorMessage = NULL;
+  return load(compiler.code, compiler.length);
+}
+
+// Also used for programs read back from flash, so the code is checked before
+// it's trusted: every opcode known, every operand present, the stack always
+// in bounds, and every rule ending in THEN.
+bool RuleEngine::load(const uint8_t *code, uint16_t codeLength) {
+  uint8_t count;
+  if (codeLength > sizeof(program) || !verify(code, codeLength, count)) {
+    errorMessage = "invalid program";
+    errorPosition = 0;
+    return false;
+  }
+  memcpy(program, code, codeLength);
+  length = codeLength;
+  rules = count;
+  timerRunning = 0;
+  return true;
+}
+
+void RuleEngine::clear() {
+  length = 0;
+  rules = 0;
+  timerRunning = 0;
+}
+
+const uint8_t *RuleEngine::code() {
+  return program;
+}
+
+uint16_t RuleEngine::codeLength() {
+  return length;
+}
+
+uint8_t RuleEngine::ruleCount() {
+  return rules;
+}
+
+const char *RuleEngine::error() {
+  return errorMessage;
+}
+
+uint16_t RuleEngine::errorAt() {
+  return errorPosition;
+}
+
+bool RuleEngine::verify(const uint8_t *code, uint16_t codeLength, uint8_t &ruleCount) {
+  uint8_t depth = 0;
+  uint16_t pc = 0;
+  ruleCount = 0;
+
+  while (pc < codeLength) {
+    switch (code[pc]) {
+      case RULE_OP_LOAD:
+        if (pc + 2 > codeLength || code[pc + 1] >= RULE_CHANNELS || depth == RULE_MAX_STACK) {
+          return false;
+        }
+        depth++;
+        pc += 2;
+        break;
+      case RULE_OP_CONST:
+        if (pc + 5 > codeLength || depth == RULE_MAX_STACK) {
+          return false;
+        }
+        depth++;
+        pc += 5;
+        break;
+      case RULE_OP_GT:
+      case RULE_OP_LT:
+      case RULE_OP_GE:
+      case RULE_OP_LE:
+      case RULE_OP_AND:
+        if (depth < 2) {
+          return false;
+        }
+        depth--;
+        pc += 1;
+        break;
+      case RULE_OP_FOR:
+        if (pc + 4 > codeLength || code[pc + 1] >= RULE_MAX_TIMERS || depth < 1) {
+          return false;
+        }
+        pc += 4;
+        break;
+      case RULE_OP_THEN:
+        if (pc + 2 > codeLength || depth != 1 || code[pc + 1] == RULE_ACTION_NONE ||
+            code[pc + 1] > RULE_ACTION_OFF) {
+          return false;
+        }
+        depth = 0;
+        ruleCount++;
+        pc += 2;
+        break;
+      default:
+        return false;
+    }
+  }
+  return depth == 0;
+}
+
+enum RuleAction RuleEngine::evaluate(const int32_t *channels, unsigned long now) {
+  int32_t stack[RULE_MAX_STACK];
+  uint8_t sp = 0;
+  enum RuleAction action = RULE_ACTION_NONE;
+  uint16_t pc = 0;
+
+  // The program was verified when it was loaded, so none of the bounds are
+  // checked again here.
+  while (pc < length) {
+    int32_t a, b;
+    switch (program[pc]) {
+      case RULE_OP_LOAD:
+        stack[sp++] = channels[program[pc + 1]];
+        pc += 2;
+        break;
+      case RULE_OP_CONST:
+        stack[sp++] = (int32_t)(program[pc + 1] | (program[pc + 2] << 8) | (program[pc + 3] << 16) |
+                                ((uint32_t)program[pc + 4] << 24));
+        pc += 5;
+        break;
+      case RULE_OP_GT:
+      case RULE_OP_LT:
+      case RULE_OP_GE:
+      case RULE_OP_LE:
+      case RULE_OP_AND:
+        b = stack[--sp];
+        a = stack[--sp];
+        switch (program[pc]) {
+          case RULE_OP_GT: stack[sp++] = a > b; break;
+          case RULE_OP_LT: stack[sp++] = a < b; break;
+          case RULE_OP_GE: stack[sp++] = a >= b; break;
+          case RULE_OP_LE: stack[sp++] = a <= b; break;
+          default: stack[sp++] = a && b; break;
+        }
+        pc += 1;
+        break;
+      case RULE_OP_FOR: {
+        uint8_t timer = program[pc + 1];
+        unsigned long duration = (program[pc + 2] | (program[pc + 3] << 8)) * 1000UL;
+        if (!stack[sp - 1]) {
+          timerRunning &= ~(1 << timer);
+        } else if (!(timerRunning & (1 << timer))) {
+          timerRunning |= 1 << timer;
+          heldSince[timer] = now;
+          stack[sp - 1] = duration == 0;
+        } else {
+          stack[sp - 1] = now - heldSince[timer] >= duration;
+        }
+        pc += 4;
+        break;
+      }
+      case RULE_OP_THEN:
+        if (stack[--sp]) {
+          action = (enum RuleAction)program[pc + 1];
+        }
+        pc += 2;
+        break;
+    }
+  }
+  return action;
+}
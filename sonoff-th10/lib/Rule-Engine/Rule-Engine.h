@@ -0,0 +1,81 @@
+#ifndef RULE_ENGINE_H_
+#define RULE_ENGINE_H_
+
+#include <Arduino.h>
+
+// Fits a whole program in one HomekitFlashRing record with room to spare.
+#define RULE_MAX_PROGRAM  112
+// Conditions with a "for" clause each need a timer.
+#define RULE_MAX_TIMERS   8
+#define RULE_MAX_STACK    8
+
+enum RuleChannel {
+  RULE_CHANNEL_HUMIDITY,
+  RULE_CHANNEL_TEMPERATURE,
+  RULE_CHANNELS,
+};
+
+enum RuleAction {
+  RULE_ACTION_NONE,
+  RULE_ACTION_ON,
+  RULE_ACTION_OFF,
+};
+
+// Opcodes. Operands follow inline, little endian.
+enum RuleOp {
+  RULE_OP_LOAD = 1,   // uint8 channel; pushes its value
+  RULE_OP_CONST,      // int32 value; pushes it
+  RULE_OP_GT,         // pops b, a; pushes a > b
+  RULE_OP_LT,
+  RULE_OP_GE,
+  RULE_OP_LE,
+  RULE_OP_AND,        // pops b, a; pushes a && b
+  RULE_OP_FOR,        // uint8 timer, uint16 seconds; true once the popped
+                      // condition has held for that long
+  RULE_OP_THEN,       // uint8 action; pops the condition and ends the rule
+};
+
+// Local automation, e.g. a humidistat:
+//
+//   humidity > 70 for 120 hysteresis 5 then on
+//
+// turns on once humidity has been above 70% for two minutes, and off again
+// once it drops below 65%. Rules are separated by ';' or newlines, and each
+// is one or more "<channel> <op> <value>" conditions joined with "and",
+// an optional "for <seconds>", an optional "hysteresis <value>" (with a
+// single condition only), then "then on" or "then off". Values are in the
+// channel's own units, with up to two decimals.
+//
+// Rules are compiled to a small stack bytecode, which is what gets stored.
+// evaluate() runs every rule in order; the last one whose condition holds
+// decides the action, and if none does the output is left alone, which is
+// what gives a pair of rules its hysteresis.
+class RuleEngine {
+  public:
+    bool compile(const char *source, unsigned int length);
+    bool load(const uint8_t *code, uint16_t length);
+    void clear();
+
+    const uint8_t *code();
+    uint16_t codeLength();
+    uint8_t ruleCount();
+    const char *error();
+    uint16_t errorAt();
+
+    // Channel values are in hundredths, as carried everywhere else.
+    enum RuleAction evaluate(const int32_t *channels, unsigned long now);
+
+  private:
+    uint8_t program[RULE_MAX_PROGRAM];
+    uint16_t length = 0;
+    uint8_t rules = 0;
+    unsigned long heldSince[RULE_MAX_TIMERS];
+    uint8_t timerRunning = 0;
+
+    const char *errorMessage = NULL;
+    uint16_t errorPosition = 0;
+
+    bool verify(const uint8_t *code, uint16_t length, uint8_t &ruleCount);
+};
+
+#endif /* RULE_ENGINE_H_ */
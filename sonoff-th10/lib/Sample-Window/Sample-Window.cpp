@@ -0,0 +1,57 @@
+#include "Sample-Window.h"
+
+void SampleWindow::add(int16_t value) {
+  if (size == 0 || value < lowest) {
+    lowest = value;
+  }
+  if (size == 0 || value > highest) {
+    highest = value;
+  }
+  samples[head] = value;
+  head = (head + 1) % SAMPLE_WINDOW_SIZE;
+  if (size < SAMPLE_WINDOW_SIZE) {
+    size++;
+  }
+}
+
+void SampleWindow::clear() {
+  head = 0;
+  size = 0;
+}
+
+void SampleWindow::resetExtremes() {
+  if (size != 0) {
+    lowest = highest = latest();
+  }
+}
+
+uint8_t SampleWindow::count() {
+  return size;
+}
+
+int16_t SampleWindow::latest() {
+  if (size == 0) {
+    return SAMPLE_WINDOW_EMPTY;
+  }
+  return samples[(head + SAMPLE_WINDOW_SIZE - 1) % SAMPLE_WINDOW_SIZE];
+}
+
+int16_t SampleWindow::minimum() {
+  return size != 0 ? lowest : SAMPLE_WINDOW_EMPTY;
+}
+
+int16_t SampleWindow::maximum() {
+  return size != 0 ? highest : SAMPLE_WINDOW_EMPTY;
+}
+
+int16_t SampleWindow::mean() {
+  if (size == 0) {
+    return SAMPLE_WINDOW_EMPTY;
+  }
+  int32_t sum = 0;
+  for (uint8_t i = 0; i < size; i++) {
+    sum += samples[i];
+  }
+  // Round half away from zero.
+  return (sum + (sum < 0 ? -(int32_t)size : size) / 2) / size;
+}
@@ -0,0 +1,39 @@
+#ifndef SAMPLE_WINDOW_H_
+#define SAMPLE_WINDOW_H_
+
+#include <Arduino.h>
+
+#ifndef SAMPLE_WINDOW_SIZE
+#define SAMPLE_WINDOW_SIZE 16
+#endif
+
+// What latest(), minimum(), maximum() and mean() return before the first
+// sample. Check count() rather than publishing it.
+#define SAMPLE_WINDOW_EMPTY INT16_MIN
+
+// A ring buffer over the most recent SAMPLE_WINDOW_SIZE samples of a single
+// fixed point channel, with the mean over whatever it currently holds. The
+// min/max go further back, to the last resetExtremes(), so a peak that has
+// already left the window isn't lost before it's reported.
+class SampleWindow {
+  public:
+    void add(int16_t value);
+    void clear();
+    // Starts the min/max again from the latest sample.
+    void resetExtremes();
+
+    uint8_t count();
+    int16_t latest();
+    int16_t minimum();
+    int16_t maximum();
+    int16_t mean();
+
+  private:
+    int16_t samples[SAMPLE_WINDOW_SIZE];
+    uint8_t head = 0;
+    uint8_t size = 0;
+    int16_t lowest;
+    int16_t highest;
+};
+
+#endif /* SAMPLE_WINDOW_H_ */
@@ -4,64 +4,677 @@
 #include <PubSubClient.h>
 #include <Ticker.h>
 #include <EEPROM.h>
-#include "DHT.h"
+#include <DHT-Async.h>
+#include <Sample-Window.h>
+#include <Reading-History.h>
 #include <Homekit-Sonoff.h>
-#include <Timer.h>
+#include <Rule-Engine.h>
 
 #define SONOFF_BUTTON    0
 #define SONOFF_LED      13
+#define SONOFF_RELAY    12
 #define EEPROM_SALT     1263
 
 #define DHTPIN 14
-#define DHTTYPE DHT21
 
-// How often to transmit a reading in millis
-#define READING_EVERY 1000 * 30
+// How often to take a sample from the sensor in millis. The DHT21 can't
+// convert any faster than this.
+#define SAMPLE_EVERY 2000
+// Always transmit a reading at least this often, even if nothing changed.
+#define MAX_SILENCE 1000 * 60 * 5
+
+// Transmit as soon as a sample moves this far from the last transmitted
+// value, in hundredths. Can be changed at runtime by publishing to
+// deadband/<channel>.
+#define HUMIDITY_DEADBAND     100
+#define TEMPERATURE_DEADBAND  20
+
+// Readings are carried as hundredths from the sensor through to the payload.
+#define READING_DECIMALS 2
+
+// How often to add the mean of the sample window to the on-device history,
+// and the resolution it is kept at (in hundredths; the DHT21 only reports
+// tenths anyway).
+#define HISTORY_EVERY 1000 * 60
+#define HISTORY_RESOLUTION 10
+
+// Rules only act on a reading younger than this, so a dead sensor can't leave
+// the relay stuck in whatever state it was last put in by a rule.
+#define RULES_MAX_READING_AGE SAMPLE_EVERY * 3
+
+#ifdef TH10_STATE_SNAPSHOT
+// Every reading goes out as one binary message on "state" instead of eight
+// text ones, see tools/decode_state.py. Little endian, values in hundredths.
+#define STATE_SNAPSHOT_VERSION 1
+// Set when the relay is on, and when this build drives it at all.
+#define STATE_FLAG_RELAY_ON    0x01
+#define STATE_FLAG_RELAY       0x02
+
+struct __attribute__((packed)) StateSnapshot {
+  uint8_t version;
+  uint8_t flags;
+  // Latest, min, max and mean, as publishChannel().
+  int16_t humidity[4];
+  int16_t temperature[4];
+};
+#endif
+
+#ifdef TH10_DEEP_SLEEP
+// Deep sleep mode (GPIO16 must be wired to RST). The device wakes every
+// SLEEP_SAMPLE_EVERY with the radio off, takes one sample into RTC memory and
+// goes straight back to sleep. Only every SLEEP_TRANSMIT_EVERY samples, or
+// when a sample moves past the deadband, does it wake with the radio on to
+// publish the batch. The on-device history isn't kept in this mode.
+#define SLEEP_SAMPLE_EVERY    30000
+#define SLEEP_TRANSMIT_EVERY  10
+// Samples kept for the next transmission. The oldest are dropped if the broker
+// stays unreachable for longer than this.
+#define SLEEP_BATCH_SIZE      24
+// Give up and go back to sleep if a transmission takes longer than this.
+#define SLEEP_AWAKE_TIMEOUT   20000
+// Stay up longer while the config portal is open, so there's a chance to use
+// it.
+#define SLEEP_PORTAL_TIMEOUT  180000
+// How long to wait for the DHT on a sample wake.
+#define SLEEP_SAMPLE_TIMEOUT  500
+
+#define SLEEP_RTC_MAGIC 0x54483130 // "TH10"
+
+// Kept in RTC memory across deep sleep.
+struct SleepState {
+  int16_t humidity[SLEEP_BATCH_SIZE];
+  int16_t temperature[SLEEP_BATCH_SIZE];
+  uint8_t count;
+  uint8_t sinceTransmit;
+  bool transmitNext;
+  bool reported;
+  int16_t reportedHumidity;
+  int16_t reportedTemperature;
+  int16_t humidityDeadband;
+  int16_t temperatureDeadband;
+  // Timing of the wakes since the last transmission, for the metrics.
+  uint32_t sampleWakes;
+  uint32_t sampleWakeMs;
+  uint32_t sampleFailures;
+  uint32_t lastTransmitMs;
+};
+#endif
 
 
 static Homekit homekit(SONOFF_BUTTON, SONOFF_LED, EEPROM_SALT);
-static DHT dht(DHTPIN, DHTTYPE);
-static Timer t;
+static DHTAsync dht(DHTPIN, SAMPLE_EVERY);
+static ReadingHistory history(HISTORY_RESOLUTION);
+
+static SampleWindow humidity;
+static SampleWindow temperature;
+static int32_t humidityDeadband = HUMIDITY_DEADBAND;
+static int32_t temperatureDeadband = TEMPERATURE_DEADBAND;
+static int16_t reportedHumidity;
+static int16_t reportedTemperature;
+static unsigned long lastSampleAt = 0;
+static unsigned long lastReportAt = 0;
+static bool reported = false;
+#ifndef TH10_DEEP_SLEEP
+static RuleEngine rules;
+static HomekitFlashRing rulesStore(HOMEKIT_FLASH_STATE, HOMEKIT_FLASH_STATE_SECTORS);
+static enum RuleAction lastRuleAction = RULE_ACTION_NONE;
+static bool relayOn = false;
+#endif
+#ifdef TH10_DEEP_SLEEP
+static SleepState sleepState;
+static unsigned long radioStartedAt = 0;
+static unsigned long wifiConnectedAt = 0;
+static unsigned long mqttConnectedAt = 0;
+static unsigned long publishedAt = 0;
+static bool metricsSent = false;
+#endif
 
 
+void sample();
 void publishReading();
+void publishChannel(const char * name, SampleWindow &window);
+bool publishSnapshot();
 void republish(char * payload, unsigned int length);
+void setDeadband(const HomekitParams &params, char * payload, unsigned int length);
+void recordHistory();
+void requestHistory(char * payload, unsigned int length);
+void streamHistory();
+#ifndef TH10_DEEP_SLEEP
+void setState(bool on);
+void notifyState();
+void setRelay(char * payload, unsigned int length);
+void applyBinding(enum HomekitBindingAction action);
+void loadRules();
+void setRules(char * payload, unsigned int length);
+void runRules();
+#endif
+#ifdef TH10_BENCHMARK
+void benchmarkFormatting();
+void benchmarkRules();
+#endif
+#ifdef TH10_DEEP_SLEEP
+void loadSleepState();
+void sampleAndSleep();
+void transmitBatch();
+void publishBatch();
+void publishWakeMetrics();
+void sleepTick();
+void sleepUntilNextSample(bool transmitted);
+#endif
 
 
 void setup() {
   Serial.begin(115200);
+#ifdef TH10_BENCHMARK
+  benchmarkFormatting();
+  benchmarkRules();
+#endif
+#ifdef TH10_DEEP_SLEEP
+  // Sample wakes never get past here.
+  loadSleepState();
+  if (!sleepState.transmitNext) {
+    sampleAndSleep();
+  }
+  homekit.onConnect(transmitBatch);
+  radioStartedAt = millis();
+#else
   dht.begin();
+  pinMode(SONOFF_RELAY, OUTPUT);
+  digitalWrite(SONOFF_RELAY, LOW);
+  loadRules();
+#endif
 
+  homekit.setTlsProfile(HOMEKIT_TLS_MINIMAL);
   homekit.subscribeTo("republish", republish);
+  homekit.route("deadband/+", setDeadband);
+  homekit.subscribeTo("history", requestHistory);
+#ifndef TH10_DEEP_SLEEP
+  homekit.subscribeTo("relay/set", setRelay);
+  homekit.subscribeTo("rules/set", setRules);
+  homekit.onBinding(applyBinding);
+#endif
   homekit.beginConfig();
 
-  t.every(READING_EVERY, publishReading);
+#ifdef TH10_DEEP_SLEEP
+  wifiConnectedAt = millis();
+  homekit.addTask("sleep", sleepTick, HOMEKIT_TASK_NORMAL);
+#else
+  // Relay commands come in through Homekit's urgent tasks; everything here
+  // can wait for them.
+  homekit.addTask("dht", []() { dht.poll(); }, HOMEKIT_TASK_NORMAL);
+  homekit.addTask("sample", sample, HOMEKIT_TASK_NORMAL, SAMPLE_EVERY, SAMPLE_EVERY / 2);
+  homekit.addTask("rules", runRules, HOMEKIT_TASK_NORMAL);
+  homekit.addTask("history", recordHistory, HOMEKIT_TASK_BACKGROUND, HISTORY_EVERY);
+  homekit.addTask("history-stream", streamHistory, HOMEKIT_TASK_BACKGROUND);
+#endif
 }
 
 void loop() {
   homekit.tick();
-  t.update();
 }
 
+// Answered from the sensor cache, so republish requests never wait on (or
+// queue up behind) the DHT.
 void republish(char * payload, unsigned int length) {
   publishReading();
+
+  char buff[11];
+  snprintf(buff, sizeof(buff), "%lu", dht.age());
+  homekit.publish("reading-age", buff);
+}
+
+void setDeadband(const HomekitParams &params, char * payload, unsigned int length) {
+  int32_t value;
+  if (!Homekit::parseFixed(payload, length, READING_DECIMALS, value) || value < 0) {
+    Serial.println("Invalid payload provided.");
+    return;
+  }
+
+  String channel = params.get(0);
+  if (channel == "humidity") {
+    humidityDeadband = value;
+  } else if (channel == "temperature") {
+    temperatureDeadband = value;
+  } else {
+    Serial.println("Unknown deadband channel: " + channel);
+  }
+}
+
+// Pulls the latest reading out of the sensor cache into the sample windows,
+// and transmits if it has moved past the deadband or we've been quiet for too
+// long.
+void sample() {
+  const DHTReading &reading = dht.reading();
+  if (!reading.valid || reading.takenAt == lastSampleAt) {
+    return;
+  }
+  lastSampleAt = reading.takenAt;
+
+  humidity.add(reading.humidity);
+  temperature.add(reading.temperature);
+
+  if (!reported || millis() - lastReportAt >= MAX_SILENCE ||
+      abs(reading.humidity - reportedHumidity) >= humidityDeadband ||
+      abs(reading.temperature - reportedTemperature) >= temperatureDeadband) {
+    publishReading();
+  }
+}
+
+void recordHistory() {
+  if (humidity.count() != 0) {
+    history.add(humidity.mean(), temperature.mean());
+  }
+}
+
+// Replies on history/info with "<next sequence> <interval seconds>
+// <resolution> <chunks>", then streams one history/data message per block
+// (see HistoryBlock for the encoding). An optional payload of a sequence
+// number skips blocks entirely older than it.
+void requestHistory(char * payload, unsigned int length) {
+  int32_t since = 0;
+  if (length != 0 && !Homekit::parseFixed(payload, length, 0, since)) {
+    Serial.println("Invalid payload provided.");
+    return;
+  }
+
+  uint8_t chunks = history.beginStream(since < 0 ? 0 : since);
+  char buff[40];
+  snprintf(buff, sizeof(buff), "%u %u %u %u", history.sequence(), HISTORY_EVERY / 1000,
+           history.resolution(), chunks);
+  homekit.publish("history/info", buff);
+}
+
+// One block per pass through loop(), so a history request never holds up
+// anything else for long.
+void streamHistory() {
+  const HistoryBlock *block = history.nextChunk();
+  if (block != NULL) {
+    homekit.publish("history/data", (const uint8_t *)block, sizeof(HistoryBlock));
+  }
 }
 
 void publishReading() {
-  // Sensor readings may also be up to 2 seconds 'old' (its a very slow sensor)
-  char buff[7];
-  float h = dht.readHumidity();
-  float t = dht.readTemperature();
+  if (humidity.count() == 0) {
+    Serial.println("No sensor reading yet");
+    return;
+  }
+
+  if (!publishSnapshot()) {
+    publishChannel("humidity", humidity);
+    publishChannel("temperature", temperature);
+  }
+
+  reportedHumidity = humidity.latest();
+  reportedTemperature = temperature.latest();
+  humidity.resetExtremes();
+  temperature.resetExtremes();
+  lastReportAt = millis();
+  reported = true;
+}
+
+// Publishes the latest sample on <name>, the min/max since the last report on
+// <name>/min and <name>/max, so short peaks between transmissions aren't lost,
+// and the mean over the sample window on <name>/mean. Readings taken while
+// offline are queued and sent once the broker is back, so the record has no
+// gaps. Nothing goes out until there's a sample.
+void publishChannel(const char * name, SampleWindow &window) {
+  char topic[24];
+  if (window.count() == 0) {
+    return;
+  }
+
+  Serial.printf("%s: %d\n", name, window.latest());
+  homekit.publishDurable(name, window.latest(), READING_DECIMALS);
+
+  snprintf(topic, sizeof(topic), "%s/min", name);
+  homekit.publishDurable(topic, window.minimum(), READING_DECIMALS);
+
+  snprintf(topic, sizeof(topic), "%s/max", name);
+  homekit.publishDurable(topic, window.maximum(), READING_DECIMALS);
+
+  snprintf(topic, sizeof(topic), "%s/mean", name);
+  homekit.publishDurable(topic, window.mean(), READING_DECIMALS);
+}
+
+#ifndef TH10_DEEP_SLEEP
+void setState(bool on) {
+  Serial.printf("Relay State Is %s\n", on ? "On" : "Off");
+  relayOn = on;
+  digitalWrite(SONOFF_RELAY, on ? HIGH : LOW);
+  notifyState();
+}
+
+void notifyState() {
+  homekit.publish("relay", relayOn ? "1" : "0");
+}
+
+// A manual switch holds until the rules next change their mind.
+void setRelay(char * payload, unsigned int length) {
+  if (length == 1 && payload[0] == '1') {
+    setState(true);
+  } else if (length == 1 && payload[0] == '0') {
+    setState(false);
+  } else {
+    Serial.println("Invalid payload provided.");
+  }
+}
+
+// Another device's button or rules, bound to this relay.
+void applyBinding(enum HomekitBindingAction action) {
+  setState(action == HOMEKIT_BINDING_TOGGLE ? !relayOn : action == HOMEKIT_BINDING_ON);
+}
+
+// Only the compiled program is stored, and it's verified again on the way back
+// in.
+void loadRules() {
+  uint8_t code[RULE_MAX_PROGRAM];
+  uint16_t length;
+  if (!rulesStore.begin() || !rulesStore.readLatest(code, sizeof(code), length)) {
+    return;
+  }
+  if (rules.load(code, length)) {
+    Serial.printf("Loaded %u rules\n", rules.ruleCount());
+  } else {
+    Serial.println("Stored rules are invalid, ignoring them");
+  }
+}
 
-  if (!isnan(h)) {
-    dtostrf(h, -6, 2, buff);
-    Serial.printf("Humidity: %s\n",  buff);
-    homekit.publish("humidity", buff);
+// Compiles the rule text in the payload (see RuleEngine) and replies on
+// "rules" with "ok <rules> <bytes>" or "error <offset> <reason>". An empty
+// payload removes every rule.
+void setRules(char * payload, unsigned int length) {
+  char buff[48];
+  if (length == 0) {
+    rules.clear();
+  } else if (!rules.compile(payload, length)) {
+    snprintf(buff, sizeof(buff), "error %u %s", rules.errorAt(), rules.error());
+    homekit.publish("rules", buff);
+    return;
   }
 
-  if (!isnan(t)) {
-    dtostrf(t, -6, 2, buff);
-    Serial.printf("Temperature: %s\n",  buff);
-    homekit.publish("temperature", buff);
+  lastRuleAction = RULE_ACTION_NONE;
+  if (!rulesStore.append(rules.code(), rules.codeLength())) {
+    Serial.println("Failed to store rules");
   }
+  snprintf(buff, sizeof(buff), "ok %u %u", rules.ruleCount(), rules.codeLength());
+  homekit.publish("rules", buff);
+}
+
+// Evaluated on every pass through loop() against the sensor cache, so the
+// relay follows the readings without a round trip through the broker. The
+// relay is only switched when the rules' decision changes, which is also
+// passed on to any devices bound to the rule-on or rule-off events.
+void runRules() {
+  const DHTReading &reading = dht.reading();
+  if (rules.ruleCount() == 0 || !reading.valid || dht.age() > RULES_MAX_READING_AGE) {
+    return;
+  }
+
+  int32_t channels[RULE_CHANNELS];
+  channels[RULE_CHANNEL_HUMIDITY] = reading.humidity;
+  channels[RULE_CHANNEL_TEMPERATURE] = reading.temperature;
+  enum RuleAction action = rules.evaluate(channels, millis());
+  if (action == RULE_ACTION_NONE || action == lastRuleAction) {
+    return;
+  }
+  lastRuleAction = action;
+  homekit.emitBinding(action == RULE_ACTION_ON ? HOMEKIT_BINDING_RULE_ON : HOMEKIT_BINDING_RULE_OFF);
+  if (relayOn != (action == RULE_ACTION_ON)) {
+    setState(action == RULE_ACTION_ON);
+  }
+}
+#endif
+
+// Only when built with TH10_STATE_SNAPSHOT. The snapshot can't be queued in
+// flash, so while offline (or still sending the backlog) readings fall back
+// to the durable text messages.
+bool publishSnapshot() {
+#ifdef TH10_STATE_SNAPSHOT
+  if (!homekit.connected() || homekit.backlogPending() ||
+      humidity.count() == 0 || temperature.count() == 0) {
+    return false;
+  }
+
+  StateSnapshot snapshot;
+  snapshot.version = STATE_SNAPSHOT_VERSION;
+  snapshot.flags = 0;
+#ifndef TH10_DEEP_SLEEP
+  snapshot.flags = STATE_FLAG_RELAY | (relayOn ? STATE_FLAG_RELAY_ON : 0);
+#endif
+  snapshot.humidity[0] = humidity.latest();
+  snapshot.humidity[1] = humidity.minimum();
+  snapshot.humidity[2] = humidity.maximum();
+  snapshot.humidity[3] = humidity.mean();
+  snapshot.temperature[0] = temperature.latest();
+  snapshot.temperature[1] = temperature.minimum();
+  snapshot.temperature[2] = temperature.maximum();
+  snapshot.temperature[3] = temperature.mean();
+
+  Serial.printf("state: %d %d\n", snapshot.humidity[0], snapshot.temperature[0]);
+  homekit.publish("state", (const uint8_t *)&snapshot, sizeof(snapshot));
+  return true;
+#else
+  return false;
+#endif
+}
+
+#ifdef TH10_BENCHMARK
+// Compares the old float + dtostrf payload path with the fixed point one, in
+// CPU cycles per formatted value. Each transmission formats 8 values.
+void benchmarkFormatting() {
+  const uint32_t iterations = 1000;
+  volatile int16_t raw = 2153;
+  char buff[13];
+
+  uint32_t start = ESP.getCycleCount();
+  for (uint32_t i = 0; i < iterations; i++) {
+    float value = raw * 0.01;
+    dtostrf(value, -6, 2, buff);
+  }
+  uint32_t floatCycles = (ESP.getCycleCount() - start) / iterations;
+
+  start = ESP.getCycleCount();
+  for (uint32_t i = 0; i < iterations; i++) {
+    Homekit::formatFixed(buff, sizeof(buff), raw, READING_DECIMALS);
+  }
+  uint32_t fixedCycles = (ESP.getCycleCount() - start) / iterations;
+
+  Serial.printf("dtostrf: %u cycles/value, formatFixed: %u cycles/value\n", floatCycles, fixedCycles);
+  Serial.printf("Saved per transmission: %u cycles\n", (floatCycles - fixedCycles) * 8);
+}
+
+// The cost of one pass of runRules() through a typical program, in CPU cycles.
+void benchmarkRules() {
+  const char *source = "humidity > 70 for 120 hysteresis 5 then on\n"
+                       "temperature > 35 and humidity < 40 then off";
+  RuleEngine engine;
+  if (!engine.compile(source, strlen(source))) {
+    Serial.printf("Benchmark rules failed to compile: %s\n", engine.error());
+    return;
+  }
+
+  const uint32_t iterations = 1000;
+  int32_t channels[RULE_CHANNELS] = {7250, 2150};
+  volatile enum RuleAction action;
+  uint32_t start = ESP.getCycleCount();
+  for (uint32_t i = 0; i < iterations; i++) {
+    action = engine.evaluate(channels, i);
+  }
+  uint32_t cycles = (ESP.getCycleCount() - start) / iterations;
+  (void)action;
+
+  Serial.printf("Rules: %u rules in %u bytes, %u cycles/evaluation\n", engine.ruleCount(),
+                engine.codeLength(), cycles);
+}
+#endif
+
+#ifdef TH10_DEEP_SLEEP
+// Fresh state after a power cycle. The first boot transmits, so that there's
+// a chance to configure the device and it's seen to come up.
+void loadSleepState() {
+  static_assert(sizeof(SleepState) % 4 == 0, "SleepState must be a whole number of RTC blocks");
+  static_assert(sizeof(SleepState) + 8 <= HOMEKIT_RTC_USER_BLOCKS * 4, "SleepState does not fit in RTC memory");
+  if (!homekitRtcRead(HOMEKIT_RTC_USER, SLEEP_RTC_MAGIC, &sleepState, sizeof(sleepState))) {
+    memset(&sleepState, 0, sizeof(sleepState));
+    sleepState.transmitNext = true;
+    sleepState.humidityDeadband = HUMIDITY_DEADBAND;
+    sleepState.temperatureDeadband = TEMPERATURE_DEADBAND;
+  }
+
+  humidityDeadband = sleepState.humidityDeadband;
+  temperatureDeadband = sleepState.temperatureDeadband;
+  reported = sleepState.reported;
+  reportedHumidity = sleepState.reportedHumidity;
+  reportedTemperature = sleepState.reportedTemperature;
+}
+
+// The whole of a sample wake: the sensor has been powered all along, so a
+// conversion can start at once and is done in a few ms.
+void sampleAndSleep() {
+  dht.begin(true);
+  uint32_t failures = dht.failures();
+  while (!dht.reading().valid && dht.failures() == failures && millis() < SLEEP_SAMPLE_TIMEOUT) {
+    dht.poll();
+    yield();
+  }
+
+  const DHTReading &reading = dht.reading();
+  if (reading.valid) {
+    if (sleepState.count == SLEEP_BATCH_SIZE) {
+      memmove(sleepState.humidity, sleepState.humidity + 1, sizeof(int16_t) * (SLEEP_BATCH_SIZE - 1));
+      memmove(sleepState.temperature, sleepState.temperature + 1, sizeof(int16_t) * (SLEEP_BATCH_SIZE - 1));
+      sleepState.count--;
+    }
+    sleepState.humidity[sleepState.count] = reading.humidity;
+    sleepState.temperature[sleepState.count] = reading.temperature;
+    sleepState.count++;
+
+    sleepState.transmitNext = !reported ||
+        abs(reading.humidity - reportedHumidity) >= humidityDeadband ||
+        abs(reading.temperature - reportedTemperature) >= temperatureDeadband;
+  } else {
+    sleepState.sampleFailures++;
+  }
+
+  sleepState.sinceTransmit++;
+  if (sleepState.sinceTransmit >= SLEEP_TRANSMIT_EVERY) {
+    sleepState.transmitNext = true;
+  }
+  sleepState.sampleWakes++;
+  sleepState.sampleWakeMs += millis();
+  homekitRtcWrite(HOMEKIT_RTC_USER, SLEEP_RTC_MAGIC, &sleepState, sizeof(sleepState));
+
+  // Rather than keep going with the radio off, reboot straight away with it
+  // on to transmit.
+  if (sleepState.transmitNext) {
+    homekit.deepSleep(1, true);
+  } else {
+    homekit.deepSleep(SLEEP_SAMPLE_EVERY, false);
+  }
+}
+
+void transmitBatch() {
+  mqttConnectedAt = millis();
+
+  humidity.clear();
+  temperature.clear();
+  for (uint8_t i = 0; i < sleepState.count; i++) {
+    humidity.add(sleepState.humidity[i]);
+    temperature.add(sleepState.temperature[i]);
+  }
+  if (humidity.count() != 0) {
+    publishReading();
+    publishBatch();
+  }
+  publishedAt = millis();
+}
+
+// Every sample since the last transmission on "samples", oldest first, one
+// "<seconds ago> <humidity> <temperature>" per line.
+void publishBatch() {
+  char buff[SLEEP_BATCH_SIZE * 20];
+  // An int16_t with two decimals is at most "-327.68".
+  char humidity[8];
+  char temperature[8];
+  size_t used = 0;
+  buff[0] = '\0';
+  for (uint8_t i = 0; i < sleepState.count; i++) {
+    uint32_t ago = (sleepState.count - 1 - i) * (SLEEP_SAMPLE_EVERY / 1000);
+    Homekit::formatFixed(humidity, sizeof(humidity), sleepState.humidity[i], READING_DECIMALS);
+    Homekit::formatFixed(temperature, sizeof(temperature), sleepState.temperature[i], READING_DECIMALS);
+    int written = snprintf(buff + used, sizeof(buff) - used, "%u %s %s\n", ago, humidity, temperature);
+    if (written < 0 || used + written >= sizeof(buff)) {
+      // Doesn't fit, so the newest samples are left out.
+      buff[used] = '\0';
+      Serial.printf("Dropped %u samples that didn't fit the batch\n", sleepState.count - i);
+      break;
+    }
+    used += written;
+  }
+  homekit.publish("samples", buff);
+}
+
+// "radio-ms" is Wi-Fi association, "mqtt-ms" the TLS and MQTT connect, and
+// "radio-to-publish-ms" the two plus publishing the batch. "publish-ms" is the
+// same end point measured from boot.
+void publishWakeMetrics() {
+  char buff[11];
+  snprintf(buff, sizeof(buff), "%lu", wifiConnectedAt - radioStartedAt);
+  homekit.publish("metrics/wake/radio-ms", buff);
+  snprintf(buff, sizeof(buff), "%lu", mqttConnectedAt - wifiConnectedAt);
+  homekit.publish("metrics/wake/mqtt-ms", buff);
+  snprintf(buff, sizeof(buff), "%lu", publishedAt - radioStartedAt);
+  homekit.publish("metrics/wake/radio-to-publish-ms", buff);
+  snprintf(buff, sizeof(buff), "%lu", publishedAt);
+  homekit.publish("metrics/wake/publish-ms", buff);
+
+  // The previous transmission's total time awake, which can't be known until
+  // it's over.
+  snprintf(buff, sizeof(buff), "%u", sleepState.lastTransmitMs);
+  homekit.publish("metrics/wake/last-transmit-ms", buff);
+  snprintf(buff, sizeof(buff), "%u", sleepState.sampleWakes != 0 ? sleepState.sampleWakeMs / sleepState.sampleWakes : 0);
+  homekit.publish("metrics/wake/sample-ms", buff);
+  snprintf(buff, sizeof(buff), "%u", sleepState.sampleFailures);
+  homekit.publish("metrics/wake/sample-failures", buff);
+}
+
+// Runs after every tick() on a transmit wake. Metrics go out on the tick after
+// the batch so publish-ms covers the batch alone, then we sleep once the
+// flash backlog (if any) has been acknowledged.
+void sleepTick() {
+  if (publishedAt != 0 && !metricsSent) {
+    publishWakeMetrics();
+    metricsSent = true;
+    return;
+  }
+
+  if (metricsSent && !homekit.backlogPending()) {
+    sleepUntilNextSample(true);
+  } else if (millis() >= (homekit.configPortalActive() ? SLEEP_PORTAL_TIMEOUT : SLEEP_AWAKE_TIMEOUT)) {
+    Serial.println("Transmission timed out, going back to sleep");
+    sleepUntilNextSample(publishedAt != 0);
+  }
+}
+
+// An untransmitted batch is kept and retried after another
+// SLEEP_TRANSMIT_EVERY samples.
+void sleepUntilNextSample(bool transmitted) {
+  if (transmitted) {
+    sleepState.count = 0;
+    sleepState.sampleWakes = 0;
+    sleepState.sampleWakeMs = 0;
+    sleepState.sampleFailures = 0;
+  }
+  sleepState.transmitNext = false;
+  sleepState.sinceTransmit = 0;
+  sleepState.reported = reported;
+  sleepState.reportedHumidity = reportedHumidity;
+  sleepState.reportedTemperature = reportedTemperature;
+  sleepState.humidityDeadband = humidityDeadband;
+  sleepState.temperatureDeadband = temperatureDeadband;
+  sleepState.lastTransmitMs = millis();
+  homekitRtcWrite(HOMEKIT_RTC_USER, SLEEP_RTC_MAGIC, &sleepState, sizeof(sleepState));
+
+  homekit.deepSleep(SLEEP_SAMPLE_EVERY, false);
 }
+#endif
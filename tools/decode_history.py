@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+"""Decodes the TH10 on-device reading history.
+
+Subscribe to esp/<mac>/history/#, publish to esp/<mac>/history, and feed the
+history/info payload and each history/data payload to HistoryDecoder:
+
+    decoder = HistoryDecoder(info_payload)
+    for chunk in data_payloads:
+        decoder.add_chunk(chunk)
+    for seconds_ago, humidity, temperature in decoder.samples():
+        ...
+
+Humidity and temperature come out in %RH and degrees Celsius.
+"""
+
+import struct
+import sys
+
+BLOCK_FORMAT = '<IhhBB54s'
+BLOCK_SIZE = struct.calcsize(BLOCK_FORMAT)
+
+
+def _varint(data, offset):
+    result = 0
+    shift = 0
+    while True:
+        b = data[offset]
+        offset += 1
+        result |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return result, offset
+
+
+def _unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def decode_block(chunk):
+    """Yields (sequence, humidity, temperature) in storage units."""
+    first, humidity, temperature, count, length, data = struct.unpack(BLOCK_FORMAT, chunk[:BLOCK_SIZE])
+    data = bytearray(data[:length])
+    yield first, humidity, temperature
+
+    offset = 0
+    for i in range(1, count):
+        if data[offset] != 0:
+            dh = (data[offset] >> 4) - 8
+            dt = (data[offset] & 0x0F) - 8
+            offset += 1
+        else:
+            dh, offset = _varint(data, offset + 1)
+            dt, offset = _varint(data, offset)
+            dh = _unzigzag(dh)
+            dt = _unzigzag(dt)
+        humidity += dh
+        temperature += dt
+        yield first + i, humidity, temperature
+
+
+class HistoryDecoder(object):
+    def __init__(self, info):
+        if isinstance(info, bytes):
+            info = info.decode('ascii')
+        fields = [int(f) for f in info.split()]
+        self.next_sequence, self.interval, self.resolution, self.chunks = fields
+        self.blocks = []
+
+    def add_chunk(self, chunk):
+        self.blocks.append(bytearray(chunk))
+
+    def samples(self):
+        """Yields (seconds_ago, humidity, temperature), oldest first."""
+        scale = self.resolution / 100.0
+        for block in self.blocks:
+            for sequence, humidity, temperature in decode_block(block):
+                seconds_ago = (self.next_sequence - 1 - sequence) * self.interval
+                yield seconds_ago, humidity * scale, temperature * scale
+
+
+if __name__ == '__main__':
+    # Usage: decode_history.py <info payload> <chunk file>...
+    decoder = HistoryDecoder(sys.argv[1])
+    for path in sys.argv[2:]:
+        with open(path, 'rb') as f:
+            decoder.add_chunk(f.read())
+    for seconds_ago, humidity, temperature in decoder.samples():
+        print('-%6ds  %6.2f %%RH  %6.2f C' % (seconds_ago, humidity, temperature))
@@ -0,0 +1,90 @@
+#!/usr/bin/env python
+"""Decodes the TH10 state snapshot.
+
+Firmware built with TH10_STATE_SNAPSHOT publishes each reading as one binary
+message on esp/<mac>/state instead of the eight text topics (humidity,
+humidity/min, .../max, .../mean and the same for temperature):
+
+    snapshot = decode_state(payload)
+    snapshot['humidity']['mean'], snapshot['relay']
+
+Humidity and temperature come out in %RH and degrees Celsius. relay is None
+when the build doesn't drive one. While offline the firmware falls back to the
+text topics, since those are what it queues in flash.
+
+Run as a script to decode a payload saved to a file, or with --compare to see
+what one reading costs on the wire each way:
+
+    decode_state.py state.bin
+    decode_state.py --compare <mac>
+"""
+
+import struct
+import sys
+
+VERSION = 1
+FORMAT = '<BB4h4h'
+SIZE = struct.calcsize(FORMAT)
+
+FLAG_RELAY_ON = 0x01
+FLAG_RELAY = 0x02
+
+FIELDS = ('latest', 'min', 'max', 'mean')
+
+
+def decode_state(payload):
+    if len(payload) != SIZE:
+        raise ValueError('expected %d bytes, got %d' % (SIZE, len(payload)))
+    values = struct.unpack(FORMAT, bytes(payload))
+    version, flags = values[:2]
+    if version != VERSION:
+        raise ValueError('unknown snapshot version %d' % version)
+    relay = None
+    if flags & FLAG_RELAY:
+        relay = 1 if flags & FLAG_RELAY_ON else 0
+    return {
+        'relay': relay,
+        'humidity': dict(zip(FIELDS, [v / 100.0 for v in values[2:6]])),
+        'temperature': dict(zip(FIELDS, [v / 100.0 for v in values[6:10]])),
+    }
+
+
+def publish_size(topic, payload_length):
+    """Bytes of an MQTT 3.1.1 QoS 0 PUBLISH packet."""
+    remaining = 2 + len(topic) + payload_length
+    length_bytes = 1
+    while remaining >= 128 ** length_bytes:
+        length_bytes += 1
+    return 1 + length_bytes + remaining
+
+
+def compare(mac, humidity='55.25', temperature='-12.50'):
+    """Returns (text bytes, text publishes, snapshot bytes, snapshot publishes)."""
+    prefix = 'esp/%s/' % mac
+    text = 0
+    count = 0
+    for name, value in (('humidity', humidity), ('temperature', temperature)):
+        for suffix in ('', '/min', '/max', '/mean'):
+            text += publish_size(prefix + name + suffix, len(value))
+            count += 1
+    return text, count, publish_size(prefix + 'state', SIZE), 1
+
+
+if __name__ == '__main__':
+    # Usage: decode_state.py <payload file> | --compare <mac>
+    if sys.argv[1] == '--compare':
+        text, text_count, snapshot, snapshot_count = compare(sys.argv[2])
+        print('text      %4d bytes in %d publishes' % (text, text_count))
+        print('snapshot  %4d bytes in %d publish' % (snapshot, snapshot_count))
+        # Homekit's write buffer already puts a reading's publishes into one
+        # TLS record, so the saving is in MQTT framing, topics and broker work.
+        print('saved     %4d bytes (%d%%)' % (text - snapshot, 100 * (text - snapshot) // text))
+    else:
+        with open(sys.argv[1], 'rb') as f:
+            snapshot = decode_state(f.read())
+        if snapshot['relay'] is not None:
+            print('relay        %d' % snapshot['relay'])
+        for name, unit in (('humidity', '%RH'), ('temperature', 'C')):
+            values = snapshot[name]
+            print('%-12s %6.2f %s  (min %.2f, max %.2f, mean %.2f)' % (
+                name, values['latest'], unit, values['min'], values['max'], values['mean']))
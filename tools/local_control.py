@@ -0,0 +1,131 @@
+#!/usr/bin/env python
+"""Talks to the relay's local control endpoint over UDP.
+
+Local control is off until a key is set, either in the config portal or by
+publishing it to device/<mac>/local-key/set. Then:
+
+    client = LocalControl('192.168.1.40', 'the key')
+    state = client.send('toggle')
+
+send() takes anything relay/set accepts ("1", "0", "toggle", "pulse 500",
+...) or "get", and returns the relay state afterwards as 0 or 1.
+
+Run as a script to send one command, or with --bench to time a run of them:
+
+    local_control.py 192.168.1.40 'the key' toggle
+    local_control.py 192.168.1.40 'the key' --bench 500 toggle
+"""
+
+import hashlib
+import hmac
+import socket
+import struct
+import sys
+import time
+
+PORT = 4210
+MAGIC = 0x4b48
+VERSION = 1
+HEADER_FORMAT = '<HBBII'
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+TAG_SIZE = 16
+
+STATUS_OK = 0
+STATUS_INVALID = 1
+STATUS_STALE = 2
+
+
+class LocalControlError(Exception):
+    pass
+
+
+class LocalControl(object):
+    def __init__(self, host, key, port=PORT, timeout=0.5, retries=3):
+        self.address = (host, port)
+        self.key = key.encode('utf-8') if not isinstance(key, bytes) else key
+        self.timeout = timeout
+        self.retries = retries
+        self.boot = 0
+        self.sequence = 0
+        self.socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.socket.settimeout(timeout)
+
+    def _tag(self, data):
+        return hmac.new(self.key, data, hashlib.sha256).digest()[:TAG_SIZE]
+
+    def _exchange(self, command):
+        self.sequence += 1
+        packet = struct.pack(HEADER_FORMAT, MAGIC, VERSION, 0, self.boot, self.sequence) + command
+        self.socket.sendto(packet + self._tag(packet), self.address)
+
+        while True:
+            reply, _ = self.socket.recvfrom(64)
+            body, tag = reply[:-TAG_SIZE], reply[-TAG_SIZE:]
+            if len(body) != HEADER_SIZE + 1 or not hmac.compare_digest(tag, self._tag(body)):
+                continue
+            magic, version, status, boot, sequence = struct.unpack(HEADER_FORMAT, body[:HEADER_SIZE])
+            if magic != MAGIC or version != VERSION:
+                continue
+            if status == STATUS_STALE:
+                # First contact, a reboot, or another client got ahead of us.
+                self.boot = boot
+                self.sequence = sequence
+                return None
+            if sequence != self.sequence:
+                # A late reply to an earlier attempt.
+                continue
+            if status == STATUS_INVALID:
+                raise LocalControlError('command rejected: %r' % command)
+            return int(body[HEADER_SIZE:HEADER_SIZE + 1])
+
+    def send(self, command):
+        """Returns the relay state after the command, as 0 or 1."""
+        if not isinstance(command, bytes):
+            command = command.encode('ascii')
+        # A stale reply costs one round trip; a lost datagram costs a timeout.
+        for _ in range(self.retries + 1):
+            try:
+                state = self._exchange(command)
+            except socket.timeout:
+                continue
+            if state is not None:
+                return state
+        raise LocalControlError('no reply from %s:%d' % self.address)
+
+
+def percentile(sorted_values, fraction):
+    index = min(len(sorted_values) - 1, int(round(fraction * (len(sorted_values) - 1))))
+    return sorted_values[index]
+
+
+def bench(client, command, count):
+    """Times count round trips, returning (latencies in ms, failures)."""
+    client.send('get')
+    latencies = []
+    failures = 0
+    for _ in range(count):
+        started = time.time()
+        try:
+            client.send(command)
+        except LocalControlError:
+            failures += 1
+            continue
+        latencies.append((time.time() - started) * 1000.0)
+    return sorted(latencies), failures
+
+
+if __name__ == '__main__':
+    # Usage: local_control.py <host> <key> [--bench <count>] <command>
+    args = sys.argv[1:]
+    host, key = args[0], args[1]
+    client = LocalControl(host, key)
+    if args[2] == '--bench':
+        latencies, failures = bench(client, args[4], int(args[3]))
+        if not latencies:
+            sys.exit('No replies')
+        print('%d replies, %d failed' % (len(latencies), failures))
+        for name, fraction in (('p50', 0.5), ('p90', 0.9), ('p99', 0.99)):
+            print('%s  %7.2f ms' % (name, percentile(latencies, fraction)))
+        print('max  %7.2f ms' % latencies[-1])
+    else:
+        print(client.send(args[2]))
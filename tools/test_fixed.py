@@ -0,0 +1,139 @@
+#!/usr/bin/env python
+"""Checks the fixed point conversions in Homekit-Sonoff against known cases.
+
+Builds sonoff-th10/lib/Homekit-Sonoff/HomekitFixed.cpp with the host's g++
+and runs homekitParseFixed() and homekitFormatFixed() over the cases below,
+overflow included:
+
+    test_fixed.py
+"""
+
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+LIBRARY = os.path.join(ROOT, 'sonoff-th10', 'lib', 'Homekit-Sonoff')
+
+# Just enough of Arduino.h for the conversions.
+ARDUINO_H = '#include <stddef.h>\n#include <stdint.h>\n'
+
+# Reads "parse <decimals> <text>" and "format <decimals> <value>" lines, where
+# text is the rest of the line and may be empty, and prints one result per
+# line: the parsed value or formatted string, or "error".
+HARNESS = r'''
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "HomekitFixed.h"
+
+int main() {
+  char line[80];
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    char *decimals = strchr(line, ' ');
+    char *text = decimals != NULL ? strchr(decimals + 1, ' ') : NULL;
+    if (text == NULL) {
+      return 1;
+    }
+    *text++ = '\0';
+    if (strncmp(line, "parse", 5) == 0) {
+      int32_t value;
+      if (homekitParseFixed(text, strlen(text), atoi(decimals + 1), value)) {
+        printf("%ld\n", (long)value);
+      } else {
+        printf("error\n");
+      }
+    } else {
+      char buffer[16];
+      if (homekitFormatFixed(buffer, sizeof(buffer), atol(text), atoi(decimals + 1)) != 0) {
+        printf("%s\n", buffer);
+      } else {
+        printf("error\n");
+      }
+    }
+  }
+  return 0;
+}
+'''
+
+# (decimals, text, expected value or None for rejected input)
+PARSE_CASES = [
+    (2, '21.53', 2153),
+    (2, '-1.5', -150),
+    (2, '+7', 700),
+    (2, '0.129', 12),
+    (1, '.5', 5),
+    (0, '42', 42),
+    (0, '2147483647', 2147483647),
+    (0, '-2147483647', -2147483647),
+    (0, '2147483648', None),
+    (0, '99999999999', None),
+    (2, '21474836.47', 2147483647),
+    (2, '21474836.48', None),
+    (2, '21474837', None),
+    (2, '', None),
+    (2, '-', None),
+    (2, '.', None),
+    (2, '1.2.3', None),
+    (2, '12a', None),
+]
+
+# (decimals, value, expected text)
+FORMAT_CASES = [
+    (2, 2153, '21.53'),
+    (2, -150, '-1.50'),
+    (2, 5, '0.05'),
+    (0, 42, '42'),
+    (1, -2147483647, '-214748364.7'),
+]
+
+
+def build(directory):
+    with open(os.path.join(directory, 'Arduino.h'), 'w') as f:
+        f.write(ARDUINO_H)
+    with open(os.path.join(directory, 'harness.cpp'), 'w') as f:
+        f.write(HARNESS)
+    binary = os.path.join(directory, 'harness')
+    subprocess.check_call(['g++', '-std=gnu++11', '-Wall', '-I', directory, '-I', LIBRARY,
+                           os.path.join(directory, 'harness.cpp'),
+                           os.path.join(LIBRARY, 'HomekitFixed.cpp'), '-o', binary])
+    return binary
+
+
+def main():
+    lines = []
+    for decimals, text, _ in PARSE_CASES:
+        lines.append('parse %d %s' % (decimals, text))
+    for decimals, value, _ in FORMAT_CASES:
+        lines.append('format %d %d' % (decimals, value))
+
+    directory = tempfile.mkdtemp()
+    try:
+        binary = build(directory)
+        process = subprocess.Popen([binary], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        output = process.communicate(('\n'.join(lines) + '\n').encode('ascii'))[0]
+        output = output.decode('ascii').split('\n')
+    finally:
+        shutil.rmtree(directory)
+
+    failures = []
+    for i, (decimals, text, expected) in enumerate(PARSE_CASES):
+        want = 'error' if expected is None else str(expected)
+        if output[i] != want:
+            failures.append('parse %r with %d decimals gave %s, expected %s' % (text, decimals, output[i], want))
+    for i, (decimals, value, expected) in enumerate(FORMAT_CASES):
+        got = output[len(PARSE_CASES) + i]
+        if got != expected:
+            failures.append('format %d with %d decimals gave %s, expected %s' % (value, decimals, got, expected))
+
+    print('%d cases' % (len(PARSE_CASES) + len(FORMAT_CASES)))
+    for failure in failures:
+        print('FAIL: ' + failure)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,123 @@
+#!/usr/bin/env python
+"""Round-trips synthetic samples through the TH10 history encoder.
+
+Builds sonoff-th10/lib/Reading-History with the host's g++, feeds it a seeded
+random walk of readings (small steps, with the odd jump and negative
+temperatures so both encodings are used), and checks that decode_history.py
+gets back every sample the ring still holds, with the oldest blocks dropped:
+
+    test_history.py [samples]
+"""
+
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import decode_history
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+LIBRARY = os.path.join(ROOT, 'sonoff-th10', 'lib', 'Reading-History')
+RESOLUTION = 10
+
+# Just enough of Arduino.h for the encoder.
+ARDUINO_H = '#include <stdint.h>\n#include <string.h>\n'
+
+# Reads "<humidity> <temperature>" lines in hundredths, then prints the
+# sequence and one hex line per block, as streamed on history/data.
+HARNESS = r'''
+#include <stdio.h>
+#include "Reading-History.h"
+
+int main() {
+  ReadingHistory history(%d);
+  int humidity, temperature;
+  while (scanf("%%d %%d", &humidity, &temperature) == 2) {
+    history.add(humidity, temperature);
+  }
+  printf("%%u\n", history.sequence());
+  history.beginStream(0);
+  const HistoryBlock *block;
+  while ((block = history.nextChunk()) != NULL) {
+    for (size_t i = 0; i < sizeof(HistoryBlock); i++) {
+      printf("%%02x", ((const uint8_t *)block)[i]);
+    }
+    printf("\n");
+  }
+  return 0;
+}
+''' % RESOLUTION
+
+
+def build(directory):
+    with open(os.path.join(directory, 'Arduino.h'), 'w') as f:
+        f.write(ARDUINO_H)
+    with open(os.path.join(directory, 'harness.cpp'), 'w') as f:
+        f.write(HARNESS)
+    binary = os.path.join(directory, 'harness')
+    subprocess.check_call(['g++', '-std=gnu++11', '-Wall', '-I', directory, '-I', LIBRARY,
+                           os.path.join(directory, 'harness.cpp'),
+                           os.path.join(LIBRARY, 'Reading-History.cpp'), '-o', binary])
+    return binary
+
+
+def synthetic(count, seed=1):
+    rng = random.Random(seed)
+    humidity, temperature = 5500, 150
+    samples = []
+    for _ in range(count):
+        if rng.random() < 0.05:
+            humidity += rng.randint(-1500, 1500)
+            temperature += rng.randint(-1500, 1500)
+        else:
+            humidity += rng.randint(-60, 60)
+            temperature += rng.randint(-60, 60)
+        humidity = max(0, min(10000, humidity))
+        temperature = max(-4000, min(8000, temperature))
+        samples.append((humidity, temperature))
+    return samples
+
+
+def stored(value):
+    """The encoder's rounding to the storage resolution, half away from zero."""
+    half = RESOLUTION // 2
+    return int((value + (half if value >= 0 else -half)) / float(RESOLUTION))
+
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 1200
+    samples = synthetic(count)
+
+    directory = tempfile.mkdtemp()
+    try:
+        binary = build(directory)
+        text = ''.join('%d %d\n' % sample for sample in samples)
+        process = subprocess.Popen([binary], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        output = process.communicate(text.encode('ascii'))[0].decode('ascii').split()
+    finally:
+        shutil.rmtree(directory)
+
+    sequence = int(output[0])
+    decoded = []
+    for line in output[1:]:
+        decoded.extend(decode_history.decode_block(bytearray.fromhex(line)))
+
+    expected = [(i, stored(h), stored(t)) for i, (h, t) in enumerate(samples)]
+    failures = []
+    if sequence != count:
+        failures.append('sequence %d, expected %d' % (sequence, count))
+    if not decoded or decoded[-1][0] != count - 1:
+        failures.append('newest sample missing')
+    elif decoded != expected[decoded[0][0]:]:
+        failures.append('decoded samples differ from those added')
+
+    print('%d samples added, %d decoded from %d blocks' % (count, len(decoded), len(output) - 1))
+    for failure in failures:
+        print('FAIL: ' + failure)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())